@@ -0,0 +1,131 @@
+#include "audioFile.h"
+
+#include <cstring>
+
+#include "detectors.h"
+
+static uint32_t le32(const unsigned char *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+static uint16_t le16(const unsigned char *p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+
+SampleReader::SampleReader() : m_file(NULL), m_format(kFloat32), m_channels(1), m_bytesPerSample(4),
+                               m_remaining(-1), m_sampleRate(DETECTORS_SAMPLE_RATE) {}
+
+SampleReader::~SampleReader() {
+    if(m_file && m_file != stdin) fclose(m_file);
+}
+
+bool SampleReader::open(const char *path, bool raw) {
+    m_file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if(!m_file) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+    return raw ? true : readWavHeader(path);
+}
+
+size_t SampleReader::read(float *out, size_t n) {
+    if(m_remaining >= 0 && static_cast<long long>(n) > m_remaining) n = static_cast<size_t>(m_remaining);
+    size_t frameBytes = m_bytesPerSample * m_channels;
+    m_scratch.resize(n * frameBytes);
+    size_t frames = fread(&m_scratch[0], frameBytes, n, m_file);
+    if(m_remaining >= 0) m_remaining -= frames;
+    for(size_t i = 0; i < frames; ++i) {
+        out[i] = decode(&m_scratch[i * frameBytes]);
+    }
+    return frames;
+}
+
+float SampleReader::decode(const unsigned char *p) const {
+    switch(m_format) {
+    case kPcm16: return static_cast<int16_t>(le16(p)) / 32768.0f;
+    case kPcm24: return static_cast<int32_t>((p[0] << 8) | (p[1] << 16) | (uint32_t(p[2]) << 24)) / 2147483648.0f;
+    case kPcm32: return static_cast<int32_t>(le32(p)) / 2147483648.0f;
+    case kFloat32: {
+        uint32_t bits = le32(p);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    }
+    return 0.0f;
+}
+
+bool SampleReader::readWavHeader(const char *path) {
+    unsigned char riff[12];
+    if(fread(riff, 1, 12, m_file) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff+8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s is not a WAV file, use --raw for headerless float32\n", path);
+        return false;
+    }
+    bool haveFormat = false;
+    unsigned char chunk[8];
+    while(fread(chunk, 1, 8, m_file) == 8) {
+        uint32_t size = le32(chunk+4);
+        if(memcmp(chunk, "fmt ", 4) == 0) {
+            std::vector<unsigned char> fmt(size);
+            if(size < 16 || fread(&fmt[0], 1, size, m_file) != size) break;
+            unsigned tag = le16(&fmt[0]);
+            m_channels = le16(&fmt[2]);
+            m_sampleRate = le32(&fmt[4]);
+            unsigned bits = le16(&fmt[14]);
+            if(tag == 0xfffe && size >= 26) tag = le16(&fmt[24]); // WAVE_FORMAT_EXTENSIBLE sub format
+            m_bytesPerSample = bits / 8;
+            if(tag == 3 && bits == 32) m_format = kFloat32;
+            else if(tag == 1 && bits == 16) m_format = kPcm16;
+            else if(tag == 1 && bits == 24) m_format = kPcm24;
+            else if(tag == 1 && bits == 32) m_format = kPcm32;
+            else {
+                fprintf(stderr, "%s: unsupported WAV format %u with %u bits\n", path, tag, bits);
+                return false;
+            }
+            haveFormat = true;
+            if((size & 1) && !skip(1)) break;
+        } else if(memcmp(chunk, "data", 4) == 0) {
+            if(!haveFormat || m_channels == 0) break;
+            m_remaining = size / (m_bytesPerSample * m_channels);
+            return true;
+        } else {
+            if(!skip(size + (size & 1))) break;
+        }
+    }
+    fprintf(stderr, "%s: missing fmt or data chunk\n", path);
+    return false;
+}
+
+// Reads past bytes rather than seeking, which pipes can't do
+bool SampleReader::skip(size_t bytes) {
+    unsigned char scratch[256];
+    while(bytes > 0) {
+        size_t n = fread(scratch, 1, bytes < sizeof(scratch) ? bytes : sizeof(scratch), m_file);
+        if(n == 0) return false;
+        bytes -= n;
+    }
+    return true;
+}
+
+bool writeWav(const char *path, const std::vector<float> &samples, double sampleRate) {
+    FILE *f = fopen(path, "wb");
+    if(!f) return false;
+    // written in native byte order, so this assumes a little endian host like everything we run on
+    uint32_t dataBytes = static_cast<uint32_t>(samples.size() * sizeof(float));
+    uint32_t riffSize = 36 + dataBytes;
+    uint32_t rate = static_cast<uint32_t>(sampleRate);
+    unsigned char header[44];
+    memcpy(header, "RIFF", 4);
+    memcpy(header+4, &riffSize, 4);
+    memcpy(header+8, "WAVEfmt ", 8);
+    uint32_t fmtSize = 16, byteRate = rate * 4;
+    uint16_t tag = 3, channels = 1, blockAlign = 4, bits = 32;
+    memcpy(header+16, &fmtSize, 4);
+    memcpy(header+20, &tag, 2);
+    memcpy(header+22, &channels, 2);
+    memcpy(header+24, &rate, 4);
+    memcpy(header+28, &byteRate, 4);
+    memcpy(header+32, &blockAlign, 2);
+    memcpy(header+34, &bits, 2);
+    memcpy(header+36, "data", 4);
+    memcpy(header+40, &dataBytes, 4);
+    bool ok = fwrite(header, 1, 44, f) == 44 &&
+              fwrite(&samples[0], sizeof(float), samples.size(), f) == samples.size();
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef _AUDIO_FILE_H_
+#define _AUDIO_FILE_H_
+
+// Reading and writing the sound files the tools work on, shared by popclick-bench, popclick-templates and the
+// file source of the capture pipeline
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Reads mono float samples from a WAV file (16/24/32 bit PCM or 32 bit float, first channel only)
+// or a headerless float32 file at DETECTORS_SAMPLE_RATE, a block at a time so long recordings never have to
+// fit in memory.
+class SampleReader {
+public:
+    SampleReader();
+    ~SampleReader();
+
+    // path can be "-" for stdin, which works through a pipe since the header is only ever read forwards
+    bool open(const char *path, bool raw);
+    double sampleRate() const { return m_sampleRate; }
+
+    // Fills up to n samples, returning how many were read
+    size_t read(float *out, size_t n);
+
+private:
+    enum Format { kPcm16, kPcm24, kPcm32, kFloat32 };
+
+    FILE *m_file;
+    Format m_format;
+    unsigned m_channels;
+    unsigned m_bytesPerSample;
+    long long m_remaining; // samples left in the data chunk, -1 for raw files
+    double m_sampleRate;
+    std::vector<unsigned char> m_scratch;
+
+    float decode(const unsigned char *p) const;
+    bool skip(size_t bytes);
+    bool readWavHeader(const char *path);
+};
+
+// Writes mono float32 samples as a WAV file
+bool writeWav(const char *path, const std::vector<float> &samples, double sampleRate);
+
+#endif
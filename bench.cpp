@@ -0,0 +1,674 @@
+// Offline runner for the detectors: streams a WAV or raw float32 file (or a synthetic test signal) through
+// detectors_process one block at a time (or detectors_push any number of samples at a time), prints the events
+// it detects, times every call and optionally scores the events against a labelled ground truth file.
+//
+// Ground truth files have one event per line, "<seconds> <event>" where event is tss_start, tss_stop or pop
+// (or the numeric event codes 1, 2 and 4). Blank lines and lines starting with # are ignored. Events of
+// templates from a template pack with their own codes are printed as the code number.
+
+#include "audioFile.h"
+#include "detectors.h"
+#include "detectorBank.h"
+#include "detectorPool.h"
+#include "detectorTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static const int kBlockSize = DETECTORS_BLOCK_SIZE;
+static const double kDefaultSampleRate = DETECTORS_SAMPLE_RATE;
+static const int kEventCodes[] = {TSS_START_CODE, TSS_STOP_CODE, POP_CODE};
+static const char *kEventNames[] = {"tss_start", "tss_stop", "pop"};
+static const int kNumEventTypes = 3;
+static const int kHopSize = DETECTORS_BLOCK_SIZE / 4;
+// How far apart the two engines' events can be and still count as the same event
+static const double kEngineMatchSeconds = 1.0;
+
+// What --compare-engines needs of the filterbank engine's events of one type: the share of them on the same
+// hop as the FFT engine's and the share within some hops of it, events only one engine reports counting against
+// both. Starts and pops come from the same decisions on nearly the same levels. A stop comes once the main band
+// falls under the other bands' level saved at the start, which in quiet white noise is the main band's own level,
+// so the hop where it first crosses is down to the noise in each engine's estimate. Half the stops land on the
+// same hop, most of the rest within a few blocks, and a few take up to a second longer in one engine or, below
+// 44.1kHz where the lower band stands in for the upper one, never come until the next "sss".
+struct EngineLimit {
+    double same;
+    int hops;
+    double close;
+};
+static const EngineLimit kEngineLimits[kNumEventTypes] = {{0.8, 1, 0.95}, {0.3, 24, 0.85}, {0.99, 1, 1.0}};
+
+struct Event {
+    double time;
+    int code;
+};
+
+// ===================== Synthetic signals =================================
+
+// A repeatable test signal needing no recordings: quiet white noise with "sss" sounds made of band limited
+// noise in the detector's main band (bins 40-100, about 3.4-8.6kHz) and pops made of short rising chirps like
+// the ones the pop template was recorded from. Returns the ground truth onsets of everything it added.
+static vector<Event> synthesize(vector<float> &samples, double seconds, double sampleRate, unsigned seed) {
+    mt19937 rng(seed);
+    normal_distribution<float> noise(0.0f, 1.0f);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    size_t n = static_cast<size_t>(seconds * sampleRate);
+    samples.resize(n);
+    for(size_t i = 0; i < n; ++i) samples[i] = 0.001f * noise(rng);
+
+    vector<Event> truth;
+    const int kPartials = 120;
+    double t = 1.0;
+    bool nextIsTss = true;
+    while(t + 2.0 < seconds) {
+        size_t start = static_cast<size_t>(t * sampleRate);
+        if(nextIsTss) {
+            double length = 0.5 + 1.5 * uniform(rng);
+            double amp = 0.01 * (0.5 + uniform(rng));
+            size_t len = static_cast<size_t>(length * sampleRate);
+            vector<double> phases(kPartials);
+            for(int j = 0; j < kPartials; ++j) phases[j] = 2.0 * M_PI * uniform(rng);
+            for(size_t i = 0; i < len; ++i) {
+                double s = 0.0;
+                for(int j = 0; j < kPartials; ++j) {
+                    double freq = 3600.0 + j * 40.0;
+                    if(freq >= 0.5 * sampleRate) break; // lower rates only get the part of the band they can hold
+                    s += sin(2.0 * M_PI * freq * i / sampleRate + phases[j]);
+                }
+                samples[start+i] += static_cast<float>(amp * s / sqrt(static_cast<double>(kPartials)));
+            }
+            Event on = {t, TSS_START_CODE}, off = {t + length, TSS_STOP_CODE};
+            truth.push_back(on);
+            truth.push_back(off);
+            t += length;
+        } else {
+            double length = 0.015 + 0.015 * uniform(rng);
+            double amp = 0.05 + 0.3 * uniform(rng);
+            double f0 = 400.0 + 300.0 * uniform(rng);
+            double f1 = f0 + 300.0 + 200.0 * uniform(rng);
+            size_t len = static_cast<size_t>(length * sampleRate);
+            double phase = 0.0;
+            for(size_t i = 0; i < len; ++i) {
+                double x = static_cast<double>(i) / len;
+                phase += 2.0 * M_PI * (f0 + (f1 - f0) * x) / sampleRate;
+                samples[start+i] += static_cast<float>(amp * sin(M_PI * x) * sin(phase));
+            }
+            Event pop = {t, POP_CODE};
+            truth.push_back(pop);
+        }
+        nextIsTss = !nextIsTss;
+        t += 1.0 + 1.5 * uniform(rng);
+    }
+    return truth;
+}
+
+// ===================== Ground truth =================================
+
+static int eventCode(const char *name) {
+    for(int i = 0; i < kNumEventTypes; ++i) {
+        if(strcmp(name, kEventNames[i]) == 0) return kEventCodes[i];
+    }
+    int code = atoi(name);
+    for(int i = 0; i < kNumEventTypes; ++i) {
+        if(code == kEventCodes[i]) return code;
+    }
+    return 0;
+}
+
+static const char *eventName(int code) {
+    for(int i = 0; i < kNumEventTypes; ++i) {
+        if(code == kEventCodes[i]) return kEventNames[i];
+    }
+    return "unknown";
+}
+
+static bool readLabels(const char *path, vector<Event> &labels) {
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        fprintf(stderr, "Can't open labels %s\n", path);
+        return false;
+    }
+    char line[256];
+    while(fgets(line, sizeof(line), f)) {
+        double time;
+        char name[64];
+        if(line[0] == '#' || sscanf(line, "%lf %63s", &time, name) != 2) continue;
+        Event ev = {time, eventCode(name)};
+        if(ev.code == 0) {
+            fprintf(stderr, "Unknown event in labels: %s", line);
+            continue;
+        }
+        labels.push_back(ev);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool writeLabels(const char *path, const vector<Event> &labels) {
+    FILE *f = fopen(path, "w");
+    if(!f) return false;
+    for(size_t i = 0; i < labels.size(); ++i) {
+        fprintf(f, "%.4f %s\n", labels[i].time, eventName(labels[i].code));
+    }
+    fclose(f);
+    return true;
+}
+
+// Greedily pairs each detection with the earliest unmatched label of the same type within tolerance seconds.
+// Detections lag the sound that causes them, so only labels at or before the detection (plus a small slack)
+// are candidates.
+static void score(const vector<Event> &labels, const vector<Event> &detections, double tolerance) {
+    fprintf(stderr, "%-10s %6s %6s %6s %9s %9s\n", "event", "labels", "found", "hits", "precision", "recall");
+    for(int type = 0; type < kNumEventTypes; ++type) {
+        int code = kEventCodes[type];
+        vector<bool> used(labels.size(), false);
+        int numLabels = 0, numDetections = 0, hits = 0;
+        for(size_t i = 0; i < labels.size(); ++i) {
+            if(labels[i].code == code) numLabels += 1;
+        }
+        for(size_t d = 0; d < detections.size(); ++d) {
+            if(detections[d].code != code) continue;
+            numDetections += 1;
+            for(size_t i = 0; i < labels.size(); ++i) {
+                double lag = detections[d].time - labels[i].time;
+                if(!used[i] && labels[i].code == code && lag >= -0.05 && lag <= tolerance) {
+                    used[i] = true;
+                    hits += 1;
+                    break;
+                }
+            }
+        }
+        double precision = numDetections ? static_cast<double>(hits) / numDetections : 1.0;
+        double recall = numLabels ? static_cast<double>(hits) / numLabels : 1.0;
+        fprintf(stderr, "%-10s %6d %6d %6d %9.3f %9.3f\n", kEventNames[type], numLabels, numDetections, hits,
+                precision, recall);
+    }
+}
+
+// Collects the events detectors_push reports along with the sample they happened at
+struct PushEvents {
+    vector<pair<unsigned long long, int> > events;
+};
+
+static void collectEvent(void *userdata, int events, unsigned long long sample) {
+    static_cast<PushEvents*>(userdata)->events.push_back(make_pair(sample, events));
+}
+
+// ===================== Trace =================================
+
+// Drains a detector's trace ring into a trace file from its own thread while the detector runs, the way a
+// production reader would, and totals up the stage timings for a summary at the end.
+class TraceWriter {
+public:
+    TraceWriter() : m_file(NULL), m_detectors(NULL), m_records(0), m_running(false) {
+        for(int stage = 0; stage < DETECTORS_TRACE_STAGES; ++stage) m_ticks[stage] = 0.0;
+    }
+
+    bool open(const char *path) {
+        m_file = fopen(path, "wb");
+        if(!m_file) return false;
+        // native byte order like writeWav
+        uint32_t header[4] = {DETECTORS_TRACE_MAGIC, DETECTORS_TRACE_VERSION,
+                              static_cast<uint32_t>(sizeof(detectors_trace_record_t)), DETECTORS_SAMPLE_RATE};
+        return fwrite(header, sizeof(header), 1, m_file) == 1;
+    }
+
+    void start(detectors_t *detectors) {
+        m_detectors = detectors;
+        m_running.store(true);
+        m_thread = thread(&TraceWriter::run, this);
+    }
+
+    // Stops the reader thread and writes out whatever is left, the detector must not be processing anymore
+    void stop() {
+        if(!m_detectors) return;
+        m_running.store(false);
+        m_thread.join();
+        drain();
+        m_detectors = NULL;
+    }
+
+    void close() {
+        if(m_file) fclose(m_file);
+        m_file = NULL;
+    }
+
+    void summarize(unsigned long long dropped) const {
+        static const char *kStageNames[DETECTORS_TRACE_STAGES] = {"fft", "spectrum", "bands", "pop"};
+        fprintf(stderr, "trace: %llu hops, %llu dropped, mean ticks/hop", m_records, dropped);
+        for(int stage = 0; stage < DETECTORS_TRACE_STAGES; ++stage) {
+            fprintf(stderr, " %s %.0f", kStageNames[stage], m_records ? m_ticks[stage] / m_records : 0.0);
+        }
+        fprintf(stderr, "\n");
+    }
+
+private:
+    void run() {
+        while(m_running.load()) {
+            drain();
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+
+    void drain() {
+        detectors_trace_record_t records[256];
+        size_t n;
+        while((n = detectors_trace_drain(m_detectors, records, 256)) > 0) {
+            fwrite(records, sizeof(records[0]), n, m_file);
+            for(size_t i = 0; i < n; ++i) {
+                for(int stage = 0; stage < DETECTORS_TRACE_STAGES; ++stage) m_ticks[stage] += records[i].ticks[stage];
+            }
+            m_records += n;
+        }
+    }
+
+    FILE *m_file;
+    detectors_t *m_detectors;
+    unsigned long long m_records;
+    double m_ticks[DETECTORS_TRACE_STAGES];
+    atomic<bool> m_running;
+    thread m_thread;
+};
+
+// ===================== Thread pool scaling =================================
+
+// Counts the event bitmasks a single detector produces for the samples, to check the pool against
+static size_t countEvents(const vector<float> &samples, double sampleRate) {
+    detectors_t *detectors = detectors_new(static_cast<int>(sampleRate));
+    size_t events = 0;
+    for(size_t pos = 0; pos + kBlockSize <= samples.size(); pos += kBlockSize) {
+        if(detectors_process(detectors, &samples[pos])) events += 1;
+    }
+    detectors_free(detectors);
+    return events;
+}
+
+// Pushes a copy of the samples into every stream of a DetectorPool as fast as the workers take them and
+// reports the throughput as streams times real time
+static void benchPool(const vector<float> &samples, double sampleRate, int streams, int threads) {
+    size_t blocks = samples.size() / kBlockSize;
+    size_t expectedEvents = countEvents(samples, sampleRate) * streams;
+    detector_pool_t *pool = detector_pool_new(streams, threads, 64, static_cast<int>(sampleRate));
+    vector<size_t> next(streams, 0);
+    vector<detector_pool_event_t> events(1024);
+    size_t numEvents = 0, pushed = 0;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    while(pushed < blocks * streams) {
+        bool progress = false;
+        for(int s = 0; s < streams; ++s) {
+            while(next[s] < blocks && detector_pool_push(pool, s, &samples[next[s] * kBlockSize])) {
+                next[s] += 1;
+                pushed += 1;
+                progress = true;
+            }
+        }
+        numEvents += detector_pool_poll(pool, &events[0], static_cast<int>(events.size()));
+        if(!progress) this_thread::yield();
+    }
+    while(detector_pool_processed(pool) < pushed) {
+        numEvents += detector_pool_poll(pool, &events[0], static_cast<int>(events.size()));
+        this_thread::yield();
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    numEvents += detector_pool_poll(pool, &events[0], static_cast<int>(events.size()));
+
+    double seconds = chrono::duration_cast<chrono::duration<double> >(end - start).count();
+    double realTime = blocks * kBlockSize / sampleRate / seconds;
+    fprintf(stderr, "threads %2d: %d streams x %.0fx real time = %.0f real time streams%s\n", threads, streams,
+            realTime, realTime * streams,
+            numEvents == expectedEvents && !detector_pool_dropped(pool) ? "" : " (events don't match a single detector!)");
+    detector_pool_free(pool);
+}
+
+// ===================== Engine equivalence =================================
+
+// Every event a detector with the given engine reports for the samples, one per event bit at the exact sample
+static vector<pair<int, unsigned long long> > engineEvents(const vector<float> &samples, double sampleRate,
+                                                          int engine) {
+    detectors_config_t config;
+    detectors_default_config(&config);
+    config.engine = engine;
+    detectors_t *detectors = detectors_new_with_templates(static_cast<int>(sampleRate), &config, NULL);
+    if(!detectors) return vector<pair<int, unsigned long long> >();
+    PushEvents pushEvents;
+    if(!samples.empty()) detectors_push(detectors, &samples[0], samples.size(), collectEvent, &pushEvents);
+    detectors_free(detectors);
+    vector<pair<int, unsigned long long> > events;
+    for(size_t i = 0; i < pushEvents.events.size(); ++i) {
+        for(int type = 0; type < kNumEventTypes; ++type) {
+            if(!(pushEvents.events[i].second & kEventCodes[type])) continue;
+            events.push_back(make_pair(type, pushEvents.events[i].first));
+        }
+    }
+    return events;
+}
+
+// How far the filterbank engine's events of one type are from the FFT engine's over a corpus
+struct EngineDiff {
+    size_t events, matched, identical, close, fftOnly, filterbankOnly;
+    double offsetHops, maxHops;
+};
+
+// Runs both engines over the samples and pairs up each type's events in time order, an event with none of its
+// type from the other engine within kEngineMatchSeconds is unmatched
+static void compareEngines(const vector<float> &samples, double sampleRate, EngineDiff *diffs) {
+    vector<pair<int, unsigned long long> > fft = engineEvents(samples, sampleRate, DETECTORS_ENGINE_FFT);
+    vector<pair<int, unsigned long long> > filterbank = engineEvents(samples, sampleRate,
+                                                                     DETECTORS_ENGINE_FILTERBANK);
+    double hopsPerSample = kDefaultSampleRate / sampleRate / kHopSize;
+    double window = kEngineMatchSeconds * sampleRate;
+    for(int type = 0; type < kNumEventTypes; ++type) {
+        vector<double> a, b;
+        for(size_t i = 0; i < fft.size(); ++i) if(fft[i].first == type) a.push_back(fft[i].second);
+        for(size_t i = 0; i < filterbank.size(); ++i) if(filterbank[i].first == type) b.push_back(filterbank[i].second);
+        EngineDiff &diff = diffs[type];
+        diff.events += a.size();
+        size_t i = 0, j = 0;
+        while(i < a.size() && j < b.size()) {
+            double hops = floor((b[j] - a[i]) * hopsPerSample + 0.5);
+            if(fabs(b[j] - a[i]) > window) {
+                if(a[i] < b[j]) {
+                    diff.fftOnly += 1;
+                    ++i;
+                } else {
+                    diff.filterbankOnly += 1;
+                    ++j;
+                }
+                continue;
+            }
+            diff.matched += 1;
+            diff.identical += a[i] == b[j];
+            diff.close += fabs(hops) <= kEngineLimits[type].hops;
+            diff.offsetHops += hops;
+            diff.maxHops = max(diff.maxHops, fabs(hops));
+            ++i;
+            ++j;
+        }
+        diff.fftOnly += a.size() - i;
+        diff.filterbankOnly += b.size() - j;
+    }
+}
+
+// ===================== Main =================================
+
+static void usage() {
+    fprintf(stderr,
+        "usage: popclick-bench [options] [input.wav | --raw input.f32 | --synth seconds]\n"
+        "  --raw             input is headerless mono float32 at 44.1kHz\n"
+        "  --synth SECONDS   generate a synthetic test signal instead of reading a file\n"
+        "  --seed N          seed for --synth (default 1)\n"
+        "  --rate HZ         sample rate for --synth (default 44100)\n"
+        "  --write-wav PATH  save the synthetic signal as a float WAV\n"
+        "  --write-labels P  save the synthetic signal's ground truth\n"
+        "  --labels PATH     ground truth to compute precision/recall against\n"
+        "  --tolerance SEC   how late a detection can be and still match a label (default 0.25)\n"
+        "  --repeat N        process the input N times for more stable timings (default 1)\n"
+        "  --bank N          run N copies of the input through a DetectorBank instead, timing whole bank blocks\n"
+        "  --pool N          run N copies of the input through a DetectorPool with 1 up to one thread per core\n"
+        "  --threads T       only run --pool with T threads\n"
+        "  --chunk N         feed N samples per detectors_push call, timing events to the exact hop\n"
+        "  --engine NAME     fft (default) or filterbank\n"
+        "  --compare-engines run the input through both engines and fail if fewer of the filterbank's events land\n"
+        "                    on or near the FFT's than they're documented to\n"
+        "  --seeds N         with --synth and --compare-engines, compare over N seeds starting from --seed\n"
+        "  --templates PATH  match the pop templates in a template pack instead of the built in one\n"
+        "  --trace PATH      write the per hop trace to PATH, needs a build with make TRACE=1\n"
+        "  --quiet           don't print events\n");
+}
+
+int main(int argc, char **argv) {
+    const char *input = NULL, *labelsPath = NULL, *wavOut = NULL, *labelsOut = NULL, *tracePath = NULL;
+    const char *templatesPath = NULL;
+    bool raw = false, quiet = false, compare = false;
+    double synthSeconds = 0.0, tolerance = 0.25, synthRate = kDefaultSampleRate;
+    unsigned seed = 1;
+    int repeat = 1, bankChannels = 0, poolStreams = 0, poolThreads = 0, chunk = 0, seeds = 1;
+    detectors_config_t config;
+    detectors_default_config(&config);
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--raw" && hasValue) { raw = true; input = argv[++i]; }
+        else if(arg == "--synth" && hasValue) synthSeconds = atof(argv[++i]);
+        else if(arg == "--seed" && hasValue) seed = static_cast<unsigned>(atoi(argv[++i]));
+        else if(arg == "--rate" && hasValue) synthRate = atof(argv[++i]);
+        else if(arg == "--write-wav" && hasValue) wavOut = argv[++i];
+        else if(arg == "--write-labels" && hasValue) labelsOut = argv[++i];
+        else if(arg == "--labels" && hasValue) labelsPath = argv[++i];
+        else if(arg == "--tolerance" && hasValue) tolerance = atof(argv[++i]);
+        else if(arg == "--repeat" && hasValue) repeat = max(1, atoi(argv[++i]));
+        else if(arg == "--bank" && hasValue) bankChannels = max(1, atoi(argv[++i]));
+        else if(arg == "--pool" && hasValue) poolStreams = max(1, atoi(argv[++i]));
+        else if(arg == "--threads" && hasValue) poolThreads = max(1, atoi(argv[++i]));
+        else if(arg == "--chunk" && hasValue) chunk = max(1, atoi(argv[++i]));
+        else if(arg == "--trace" && hasValue) tracePath = argv[++i];
+        else if(arg == "--templates" && hasValue) templatesPath = argv[++i];
+        else if(arg == "--engine" && hasValue && string(argv[i+1]) == "fft") { config.engine = DETECTORS_ENGINE_FFT; ++i; }
+        else if(arg == "--engine" && hasValue && string(argv[i+1]) == "filterbank") {
+            config.engine = DETECTORS_ENGINE_FILTERBANK;
+            ++i;
+        }
+        else if(arg == "--compare-engines") compare = true;
+        else if(arg == "--seeds" && hasValue) seeds = max(1, atoi(argv[++i]));
+        else if(arg == "--quiet") quiet = true;
+        else if(arg[0] != '-' && !input) input = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if(!input && synthSeconds <= 0.0) {
+        usage();
+        return 1;
+    }
+
+    vector<Event> labels;
+    if(labelsPath && !readLabels(labelsPath, labels)) return 1;
+
+    vector<float> synth;
+    double sampleRate = kDefaultSampleRate;
+    if(synthSeconds > 0.0) {
+        sampleRate = synthRate;
+        labels = synthesize(synth, synthSeconds, sampleRate, seed);
+        if(wavOut && !writeWav(wavOut, synth, sampleRate)) fprintf(stderr, "Couldn't write %s\n", wavOut);
+        if(labelsOut && !writeLabels(labelsOut, labels)) fprintf(stderr, "Couldn't write %s\n", labelsOut);
+    }
+
+    if(compare) {
+        EngineDiff diffs[kNumEventTypes] = {};
+        for(int s = 0; s < (synthSeconds > 0.0 ? seeds : 1); ++s) {
+            if(synthSeconds > 0.0 && s > 0) synthesize(synth, synthSeconds, sampleRate, seed + s);
+            if(!synthSeconds) {
+                SampleReader reader;
+                if(!reader.open(input, raw)) return 1;
+                sampleRate = reader.sampleRate();
+                float block[kBlockSize];
+                size_t got;
+                while((got = reader.read(block, kBlockSize)) > 0) synth.insert(synth.end(), block, block + got);
+            }
+            compareEngines(synth, sampleRate, diffs);
+        }
+        bool ok = true;
+        fprintf(stderr, "event       fft   same (needed)        close (needed)  mean offset  furthest  only fft  "
+                "only filterbank\n");
+        for(int type = 0; type < kNumEventTypes; ++type) {
+            const EngineDiff &diff = diffs[type];
+            const EngineLimit &limit = kEngineLimits[type];
+            size_t all = diff.matched + diff.fftOnly + diff.filterbankOnly;
+            double same = all ? static_cast<double>(diff.identical) / all : 1.0;
+            double close = all ? static_cast<double>(diff.close) / all : 1.0;
+            double offset = diff.matched ? diff.offsetHops / diff.matched : 0.0;
+            ok = ok && same >= limit.same && close >= limit.close;
+            fprintf(stderr, "%-10s %5zu %5.1f%% (%3.0f%%) %5.1f%% in %2d (%3.0f%%) %7.2f hops %5.0f hops %9zu %16zu\n",
+                    kEventNames[type], diff.events, 100.0 * same, 100.0 * limit.same, 100.0 * close, limit.hops,
+                    100.0 * limit.close, offset, diff.maxHops, diff.fftOnly, diff.filterbankOnly);
+        }
+        fprintf(stderr, "%s\n", ok ? "engines agree" : "engines disagree!");
+        return ok ? 0 : 1;
+    }
+
+    if(poolStreams) {
+        if(!synthSeconds) {
+            SampleReader reader;
+            if(!reader.open(input, raw)) return 1;
+            sampleRate = reader.sampleRate();
+            float block[kBlockSize];
+            size_t got;
+            while((got = reader.read(block, kBlockSize)) > 0) synth.insert(synth.end(), block, block + got);
+        }
+        int maxThreads = poolThreads ? poolThreads : max(1u, thread::hardware_concurrency());
+        for(int threads = poolThreads ? poolThreads : 1; threads <= maxThreads; ++threads) {
+            benchPool(synth, sampleRate, poolStreams, threads);
+        }
+        return 0;
+    }
+
+    if((chunk || tracePath || templatesPath || config.engine != DETECTORS_ENGINE_FFT) && bankChannels) {
+        fprintf(stderr, "--chunk, --trace, --templates and --engine only apply to a single detector, not --bank\n");
+        return 1;
+    }
+    pop_templates_t *templates = NULL;
+    if(templatesPath) {
+        templates = pop_templates_load(templatesPath);
+        if(!templates) {
+            fprintf(stderr, "%s is not a valid template pack\n", templatesPath);
+            return 1;
+        }
+        fprintf(stderr, "matching %zu templates\n", pop_templates_count(templates));
+    }
+#ifndef DETECTORS_TRACE
+    if(tracePath) {
+        fprintf(stderr, "--trace needs the instrumentation compiled in, rebuild with make TRACE=1\n");
+        return 1;
+    }
+#endif
+    TraceWriter trace;
+    if(tracePath && !trace.open(tracePath)) {
+        fprintf(stderr, "Couldn't write %s\n", tracePath);
+        return 1;
+    }
+
+    vector<Event> detections;
+    vector<double> blockNanos;
+    unsigned long long totalSamples = 0;
+    detectors_pop_stats_t popStats = {0, 0};
+    for(int pass = 0; pass < repeat; ++pass) {
+        SampleReader reader;
+        if(!synthSeconds && !reader.open(input, raw)) return 1;
+        if(!synthSeconds) sampleRate = reader.sampleRate();
+        if(bankChannels && sampleRate != kDefaultSampleRate) {
+            fprintf(stderr, "--bank needs %.0fHz input but the input is %.0fHz\n", kDefaultSampleRate, sampleRate);
+            return 1;
+        }
+
+        detectors_t *detectors = bankChannels ? NULL :
+            detectors_new_with_templates(static_cast<int>(sampleRate), &config, templates);
+        if(!bankChannels && !detectors) {
+            fprintf(stderr, "Unsupported sample rate %.0fHz\n", sampleRate);
+            return 1;
+        }
+        detector_bank_t *bank = bankChannels ? detector_bank_new(bankChannels) : NULL;
+        if(tracePath && pass == 0) trace.start(detectors);
+        vector<const float*> bankBlocks(bankChannels);
+        vector<int> bankResults(bankChannels);
+        size_t callSize = chunk ? chunk : kBlockSize;
+        vector<float> buffer(callSize);
+        float *block = &buffer[0];
+        fill(bankBlocks.begin(), bankBlocks.end(), block);
+        PushEvents pushEvents;
+        unsigned long long position = 0;
+        while(true) {
+            size_t got;
+            if(synthSeconds > 0.0) {
+                got = min(callSize, static_cast<size_t>(synth.size() - position));
+                if(got) memcpy(block, &synth[position], got * sizeof(float));
+            } else {
+                got = reader.read(block, callSize);
+            }
+            // detectors_process only takes whole blocks, detectors_push takes whatever is left
+            if(got == 0 || (!chunk && got < callSize)) break;
+            position += got;
+
+            pushEvents.events.clear();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            int result;
+            if(bank) {
+                detector_bank_process(bank, &bankBlocks[0], &bankResults[0]);
+                result = bankResults[0];
+            } else if(chunk) {
+                result = detectors_push(detectors, block, got, collectEvent, &pushEvents);
+            } else {
+                result = detectors_process(detectors, block);
+            }
+            chrono::steady_clock::time_point end = chrono::steady_clock::now();
+            blockNanos.push_back(static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(end - start).count()));
+            if(bank && count(bankResults.begin(), bankResults.end(), result) != bankChannels) {
+                fprintf(stderr, "warning: bank channels disagree at %.4f\n", position / sampleRate);
+            }
+
+            if(pass != 0 || !result) continue;
+            // whole blocks are timed at their end, pushed samples at the exact hop that detected the event
+            if(!chunk) pushEvents.events.push_back(make_pair(position, result));
+            for(size_t i = 0; i < pushEvents.events.size(); ++i) {
+                // shifted in unsigned so going past the top bit ends the loop instead of overflowing
+                unsigned events = static_cast<unsigned>(pushEvents.events[i].second);
+                for(unsigned bit = 1; bit != 0 && bit <= events; bit <<= 1) {
+                    if(!(events & bit)) continue;
+                    int code = static_cast<int>(bit);
+                    Event ev = {pushEvents.events[i].first / sampleRate, code};
+                    detections.push_back(ev);
+                    if(quiet) continue;
+                    if(strcmp(eventName(code), "unknown") != 0) printf("%.4f\t%s\n", ev.time, eventName(code));
+                    else printf("%.4f\t%d\n", ev.time, code);
+                }
+            }
+        }
+        totalSamples += position * max(bankChannels, 1);
+        if(tracePath && pass == 0) {
+            trace.stop();
+            trace.summarize(detectors_trace_dropped(detectors));
+            trace.close();
+        }
+        if(detectors && pass == 0) detectors_pop_stats(detectors, &popStats);
+        if(detectors) detectors_free(detectors);
+        if(bank) detector_bank_free(bank);
+    }
+
+    if(templates) pop_templates_free(templates);
+    if(blockNanos.empty()) {
+        fprintf(stderr, "Input is empty or shorter than one block\n");
+        return 1;
+    }
+    double totalNanos = 0.0;
+    for(size_t i = 0; i < blockNanos.size(); ++i) totalNanos += blockNanos[i];
+    sort(blockNanos.begin(), blockNanos.end());
+    int streams = max(bankChannels, 1);
+    const char *unit = chunk ? "call" : "block";
+    fprintf(stderr, "%ss %zu, %.0f samples/sec, %.0fx real time for %d stream%s\n", unit, blockNanos.size(),
+            totalSamples / (totalNanos * 1e-9), totalSamples / sampleRate * 1e9 / totalNanos,
+            streams, streams == 1 ? "" : "s");
+    fprintf(stderr, "ns/%s mean %.0f p50 %.0f p99 %.0f max %.0f\n", unit, totalNanos / blockNanos.size(),
+            blockNanos[blockNanos.size() / 2], blockNanos[(blockNanos.size() * 99) / 100], blockNanos.back());
+    if(popStats.candidates) {
+        fprintf(stderr, "pop matching ran for %llu of %llu candidate hops (%.1f%%)\n", popStats.scored,
+                popStats.candidates, 100.0 * popStats.scored / popStats.candidates);
+    }
+
+    if(!labels.empty()) score(labels, detections, tolerance);
+    return 0;
+}
@@ -0,0 +1,459 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "audioFile.h"
+
+#ifdef DETECTORS_CAPTURE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+using namespace std;
+
+static const long long kLatencyBucketNs = 100000;
+
+static size_t nextPowerOfTwo(size_t n) {
+    size_t p = 1;
+    while(p < n) p <<= 1;
+    return p;
+}
+
+static void sleepNs(long long ns) {
+    if(ns <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000LL);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000LL);
+    nanosleep(&ts, NULL);
+}
+
+// Asks for SCHED_FIFO, which needs root, CAP_SYS_NICE or an rtprio limit, just below the top priority so the
+// audio thread of whatever is capturing still wins
+static bool setRealtime(pthread_t thread, int belowMax) {
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - belowMax;
+    return pthread_setschedparam(thread, SCHED_FIFO, &param) == 0;
+}
+
+static bool pinToCpu(pthread_t thread, int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    // macOS only has affinity hints, not pinning
+    (void)thread;
+    (void)cpu;
+    return false;
+#endif
+}
+
+// ===================== Sources =================================
+
+class FileSource : public CaptureSource {
+public:
+    FileSource() : m_rate(0.0), m_pace(false), m_pos(0), m_startNs(0) {}
+
+    bool open(const capture_config_t &config) {
+        if(!m_reader.open(config.device, config.rawFile != 0)) return false;
+        if(!config.rawFile && m_reader.sampleRate() != config.sampleRate) {
+            fprintf(stderr, "%s is %.0fHz but the capture is at %dHz\n", config.device, m_reader.sampleRate(),
+                    config.sampleRate);
+            return false;
+        }
+        m_rate = config.sampleRate;
+        m_pace = config.paceFile != 0;
+        return true;
+    }
+
+    long read(float *samples, size_t count, long long &captureNs) {
+        size_t got = m_reader.read(samples, count);
+        if(got == 0) return 0;
+        m_pos += got;
+        if(m_pace) {
+            // each period becomes available once the time it covers has passed, like from a device
+            if(m_startNs == 0) m_startNs = capture_now_ns();
+            captureNs = m_startNs + static_cast<long long>(m_pos * 1e9 / m_rate);
+            sleepNs(captureNs - capture_now_ns());
+        } else {
+            captureNs = capture_now_ns();
+        }
+        return static_cast<long>(got);
+    }
+
+    bool canWait() const { return !m_pace; }
+
+private:
+    SampleReader m_reader;
+    double m_rate;
+    bool m_pace;
+    unsigned long long m_pos;
+    long long m_startNs;
+};
+
+#ifdef DETECTORS_CAPTURE_ALSA
+class AlsaSource : public CaptureSource {
+public:
+    AlsaSource() : m_pcm(NULL), m_rate(0.0), m_xruns(0) {}
+    ~AlsaSource() {
+        if(m_pcm) snd_pcm_close(m_pcm);
+    }
+
+    bool open(const capture_config_t &config) {
+        const char *device = config.device ? config.device : "default";
+        int err = snd_pcm_open(&m_pcm, device, SND_PCM_STREAM_CAPTURE, 0);
+        if(err < 0) {
+            fprintf(stderr, "Can't open capture device %s: %s\n", device, snd_strerror(err));
+            m_pcm = NULL;
+            return false;
+        }
+        // small periods so each read is a hop or two, and a few of them so a late read doesn't overrun
+        snd_pcm_hw_params_t *hw;
+        snd_pcm_hw_params_alloca(&hw);
+        snd_pcm_uframes_t period = config.periodFrames;
+        snd_pcm_uframes_t buffer = period * config.devicePeriods;
+        unsigned rate = config.sampleRate;
+        if((err = snd_pcm_hw_params_any(m_pcm, hw)) < 0 ||
+           (err = snd_pcm_hw_params_set_access(m_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+           (err = snd_pcm_hw_params_set_format(m_pcm, hw, SND_PCM_FORMAT_FLOAT)) < 0 ||
+           (err = snd_pcm_hw_params_set_channels(m_pcm, hw, 1)) < 0 ||
+           (err = snd_pcm_hw_params_set_rate(m_pcm, hw, rate, 0)) < 0 ||
+           (err = snd_pcm_hw_params_set_period_size_near(m_pcm, hw, &period, NULL)) < 0 ||
+           (err = snd_pcm_hw_params_set_buffer_size_near(m_pcm, hw, &buffer)) < 0 ||
+           (err = snd_pcm_hw_params(m_pcm, hw)) < 0 ||
+           (err = snd_pcm_prepare(m_pcm)) < 0 ||
+           (err = snd_pcm_start(m_pcm)) < 0) {
+            fprintf(stderr, "Can't set up %s for mono float at %uHz: %s\n", device, rate, snd_strerror(err));
+            return false;
+        }
+        m_rate = rate;
+        return true;
+    }
+
+    long read(float *samples, size_t count, long long &captureNs) {
+        while(true) {
+            snd_pcm_sframes_t got = snd_pcm_readi(m_pcm, samples, count);
+            if(got > 0) {
+                // frames still waiting in the device were captured after the last one we got
+                snd_pcm_sframes_t delay = 0;
+                if(snd_pcm_delay(m_pcm, &delay) < 0) delay = 0;
+                captureNs = capture_now_ns() - static_cast<long long>(delay * 1e9 / m_rate);
+                return static_cast<long>(got);
+            }
+            // nothing read or a signal came in, the stream itself is still fine
+            if(got == 0 || got == -EAGAIN || got == -EINTR) continue;
+            if(got == -EPIPE) m_xruns.fetch_add(1, memory_order_relaxed);
+            // overruns and suspends restart the stream, anything else is the device going away
+            if(snd_pcm_recover(m_pcm, static_cast<int>(got), 1) < 0) return -1;
+            // recovering from an overrun leaves the stream prepared, but a resumed suspend is already running
+            if(snd_pcm_state(m_pcm) == SND_PCM_STATE_PREPARED && snd_pcm_start(m_pcm) < 0) return -1;
+        }
+    }
+
+    bool canWait() const { return false; }
+    unsigned long long xruns() const { return m_xruns.load(memory_order_relaxed); }
+
+private:
+    snd_pcm_t *m_pcm;
+    double m_rate;
+    atomic<unsigned long long> m_xruns;
+};
+#endif
+
+// ===================== Wakeup =================================
+
+#if defined(__APPLE__)
+Wakeup::Wakeup() : m_sem(dispatch_semaphore_create(0)) {}
+Wakeup::~Wakeup() {}
+void Wakeup::post() { dispatch_semaphore_signal(m_sem); }
+void Wakeup::wait() { dispatch_semaphore_wait(m_sem, DISPATCH_TIME_FOREVER); }
+#else
+Wakeup::Wakeup() { sem_init(&m_sem, 0, 0); }
+Wakeup::~Wakeup() { sem_destroy(&m_sem); }
+void Wakeup::post() { sem_post(&m_sem); }
+void Wakeup::wait() {
+    while(sem_wait(&m_sem) != 0 && errno == EINTR) {}
+}
+#endif
+
+// ===================== Pipeline =================================
+
+CapturePipeline::CapturePipeline(detectors_t *detectors, const capture_config_t &config, CaptureSource *source,
+                                 capture_notify_fn notify, void *userdata)
+    : m_detectors(detectors), m_config(config), m_source(source), m_notify(notify), m_userdata(userdata),
+      m_nsPerSample(1e9 / config.sampleRate), m_ringSamples(NULL), m_ringPeriods(NULL), m_periodHead(0),
+      m_periodTail(0), m_eventHead(0), m_eventTail(0), m_notifyPending(false), m_droppedSamples(0),
+      m_samplesPushed(0), m_samplesSkipped(0), m_currentCaptureNs(0), m_currentEnd(0), m_eventWrite(0),
+      m_processed(0), m_eventCount(0), m_droppedEvents(0), m_latencyMaxNs(0), m_droppedPeriods(0), m_highWater(0),
+      m_pinned(false), m_realtime(false), m_running(true), m_captureDone(false), m_finished(false) {
+    size_t ringPeriods = nextPowerOfTwo(max(m_config.ringPeriods, 2));
+    m_periodMask = ringPeriods - 1;
+    for(int i = 0; i < kLatencyBuckets; ++i) m_latency[i].store(0, memory_order_relaxed);
+
+    // anything failing part way, allocations or starting threads, stops whatever had been started. The source
+    // stays with the caller until the pipeline exists.
+    try {
+        m_ringSamples = new float[ringPeriods * m_config.periodFrames];
+        m_ringPeriods = new Period[ringPeriods];
+        m_detectThread = thread(&CapturePipeline::detectLoop, this);
+        bool realtime = m_config.realtime && setRealtime(m_detectThread.native_handle(), 1);
+        if(m_config.cpu >= 0) m_pinned.store(pinToCpu(m_detectThread.native_handle(), m_config.cpu));
+        if(m_source) {
+            m_captureThread = thread(&CapturePipeline::captureLoop, this);
+            if(realtime) realtime = setRealtime(m_captureThread.native_handle(), 0);
+        }
+        m_realtime.store(realtime);
+    } catch(...) {
+        m_source = NULL;
+        stop();
+        throw;
+    }
+}
+
+void *CapturePipeline::operator new(size_t size) {
+    void *p = NULL;
+    if(posix_memalign(&p, 64, size) != 0) throw std::bad_alloc();
+    return p;
+}
+
+void CapturePipeline::operator delete(void *p) {
+    free(p);
+}
+
+CapturePipeline::~CapturePipeline() {
+    stop();
+}
+
+void CapturePipeline::stop() {
+    m_running.store(false);
+    if(m_captureThread.joinable()) m_captureThread.join();
+    m_wakeup.post();
+    if(m_detectThread.joinable()) m_detectThread.join();
+    delete m_source;
+    delete[] m_ringSamples;
+    delete[] m_ringPeriods;
+}
+
+size_t CapturePipeline::write(const float *samples, size_t count, long long captureNs, bool wait) {
+    if(captureNs <= 0) captureNs = capture_now_ns();
+    size_t periodFrames = m_config.periodFrames;
+    size_t written = 0;
+    for(size_t start = 0; start < count; start += periodFrames) {
+        size_t n = min(periodFrames, count - start);
+        size_t tail = m_periodTail.load(memory_order_relaxed);
+        while(tail - m_periodHead.load(memory_order_acquire) > m_periodMask) {
+            if(!wait || !m_running.load(memory_order_relaxed)) break;
+            sleepNs(100000);
+        }
+        size_t waiting = tail - m_periodHead.load(memory_order_acquire);
+        if(waiting > m_periodMask) {
+            // the detector thread is behind, losing this period beats making the device overrun
+            m_droppedPeriods.fetch_add(1, memory_order_relaxed);
+            m_droppedSamples += n;
+            continue;
+        }
+        size_t slot = tail & m_periodMask;
+        copy(samples + start, samples + start + n, m_ringSamples + slot * periodFrames);
+        m_ringPeriods[slot].count = n;
+        m_ringPeriods[slot].skippedBefore = m_droppedSamples;
+        m_droppedSamples = 0;
+        // later parts of a long write were captured after the earlier ones
+        m_ringPeriods[slot].captureNs = captureNs - static_cast<long long>((count - start - n) * m_nsPerSample);
+        m_periodTail.store(tail + 1, memory_order_release);
+        if(waiting + 1 > m_highWater.load(memory_order_relaxed)) m_highWater.store(waiting + 1, memory_order_relaxed);
+        m_wakeup.post();
+        written += n;
+    }
+    return written;
+}
+
+void CapturePipeline::captureLoop() {
+    float *buffer = new float[m_config.periodFrames];
+    while(m_running.load(memory_order_relaxed)) {
+        long long captureNs = 0;
+        long got = m_source->read(buffer, m_config.periodFrames, captureNs);
+        if(got <= 0) break;
+        write(buffer, static_cast<size_t>(got), captureNs, m_source->canWait());
+    }
+    delete[] buffer;
+    m_captureDone.store(true, memory_order_release);
+    m_wakeup.post();
+}
+
+void CapturePipeline::detectLoop() {
+    while(true) {
+        m_wakeup.wait();
+        size_t head = m_periodHead.load(memory_order_relaxed);
+        while(head != m_periodTail.load(memory_order_acquire)) {
+            size_t slot = head & m_periodMask;
+            processPeriod(m_ringSamples + slot * m_config.periodFrames, m_ringPeriods[slot]);
+            m_periodHead.store(++head, memory_order_release);
+        }
+        // the producer marks itself done after its last period, so an empty ring then means everything was seen
+        if(m_captureDone.load(memory_order_acquire) && head == m_periodTail.load(memory_order_acquire)) {
+            m_finished.store(true, memory_order_release);
+        }
+        if(!m_running.load(memory_order_relaxed)) break;
+    }
+}
+
+void CapturePipeline::processPeriod(const float *samples, const Period &period) {
+    m_samplesSkipped += period.skippedBefore;
+    m_currentCaptureNs = period.captureNs;
+    m_currentEnd = m_samplesPushed + period.count;
+    size_t firstEvent = m_eventWrite;
+    detectors_push(m_detectors, samples, period.count, collectEvent, this);
+    m_samplesPushed = m_currentEnd;
+
+    long long doneNs = capture_now_ns();
+    if(m_eventWrite != firstEvent) {
+        for(size_t i = firstEvent; i != m_eventWrite; ++i) m_eventRing[i & (kEventQueueSize - 1)].detectNs = doneNs;
+        // seq_cst against capture_poll clearing the flag before it reads the tail, so either it sees these
+        // events or we see the flag clear and notify again
+        m_eventTail.store(m_eventWrite);
+        if(m_notify && !m_notifyPending.exchange(true)) m_notify(m_userdata);
+    }
+
+    long long latency = max(doneNs - period.captureNs, 0LL);
+    int bucket = static_cast<int>(min<long long>(latency / kLatencyBucketNs, kLatencyBuckets - 1));
+    m_latency[bucket].fetch_add(1, memory_order_relaxed);
+    if(latency > m_latencyMaxNs.load(memory_order_relaxed)) m_latencyMaxNs.store(latency, memory_order_relaxed);
+    m_processed.fetch_add(1, memory_order_relaxed);
+}
+
+void CapturePipeline::collectEvent(void *userdata, int events, unsigned long long sample) {
+    CapturePipeline *pipeline = static_cast<CapturePipeline*>(userdata);
+    pipeline->m_eventCount.fetch_add(1, memory_order_relaxed);
+    if(pipeline->m_eventWrite - pipeline->m_eventHead.load(memory_order_acquire) >= kEventQueueSize) {
+        pipeline->m_droppedEvents.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    capture_event_t &ev = pipeline->m_eventRing[pipeline->m_eventWrite & (kEventQueueSize - 1)];
+    ev.events = events;
+    // the detectors only count what they were given, the dropped periods before it happened too
+    ev.sample = sample + pipeline->m_samplesSkipped;
+    // the hop ended before the end of the period by however many samples are still to come
+    unsigned long long remaining = pipeline->m_currentEnd > sample ? pipeline->m_currentEnd - sample : 0;
+    ev.captureNs = pipeline->m_currentCaptureNs - static_cast<long long>(remaining * pipeline->m_nsPerSample);
+    ++pipeline->m_eventWrite;
+}
+
+size_t CapturePipeline::poll(capture_event_t *events, size_t maxEvents) {
+    m_notifyPending.store(false);
+    size_t head = m_eventHead.load(memory_order_relaxed);
+    size_t tail = m_eventTail.load();
+    size_t n = min(tail - head, maxEvents);
+    for(size_t i = 0; i < n; ++i) events[i] = m_eventRing[(head + i) & (kEventQueueSize - 1)];
+    m_eventHead.store(head + n, memory_order_release);
+    return n;
+}
+
+void CapturePipeline::stats(capture_stats_t &stats) const {
+    stats.periods = m_processed.load(memory_order_relaxed);
+    stats.droppedPeriods = m_droppedPeriods.load(memory_order_relaxed);
+    stats.xruns = m_source ? m_source->xruns() : 0;
+    stats.events = m_eventCount.load(memory_order_relaxed);
+    stats.droppedEvents = m_droppedEvents.load(memory_order_relaxed);
+    stats.ringHighWater = m_highWater.load(memory_order_relaxed);
+    stats.pinned = m_pinned.load(memory_order_relaxed);
+    stats.realtime = m_realtime.load(memory_order_relaxed);
+
+    unsigned long long counts[kLatencyBuckets];
+    unsigned long long total = 0;
+    for(int i = 0; i < kLatencyBuckets; ++i) total += counts[i] = m_latency[i].load(memory_order_relaxed);
+    // the upper edge of the bucket each percentile falls in
+    double percentiles[2] = {0.5, 0.99};
+    double *out[2] = {&stats.latencyP50Ms, &stats.latencyP99Ms};
+    for(int p = 0; p < 2; ++p) {
+        *out[p] = 0.0;
+        if(!total) continue;
+        unsigned long long target = static_cast<unsigned long long>(percentiles[p] * (total - 1)) + 1;
+        unsigned long long seen = 0;
+        for(int i = 0; i < kLatencyBuckets; ++i) {
+            seen += counts[i];
+            if(seen >= target) {
+                *out[p] = (i + 1) * kLatencyBucketNs / 1e6;
+                break;
+            }
+        }
+    }
+    stats.latencyMaxMs = m_latencyMaxNs.load(memory_order_relaxed) / 1e6;
+}
+
+extern "C" {
+    void capture_default_config(capture_config_t *config) {
+        config->source = CAPTURE_SOURCE_PUSH;
+        config->device = NULL;
+        config->sampleRate = DETECTORS_SAMPLE_RATE;
+        config->periodFrames = DETECTORS_BLOCK_SIZE / 4;
+        config->devicePeriods = 3;
+        config->ringPeriods = 64;
+        config->cpu = -1;
+        config->realtime = 0;
+        config->paceFile = 0;
+        config->rawFile = 0;
+    }
+
+    capture_t *capture_new(detectors_t *detectors, const capture_config_t *config, capture_notify_fn notify, void *userdata) {
+        if(!detectors || config->sampleRate <= 0 || config->periodFrames <= 0 ||
+           config->periodFrames > CAPTURE_MAX_PERIOD) {
+            return NULL;
+        }
+        CaptureSource *source = NULL;
+        if(config->source == CAPTURE_SOURCE_FILE) {
+            FileSource *file = new FileSource();
+            if(!config->device || !file->open(*config)) {
+                delete file;
+                return NULL;
+            }
+            source = file;
+        } else if(config->source == CAPTURE_SOURCE_ALSA) {
+#ifdef DETECTORS_CAPTURE_ALSA
+            AlsaSource *alsa = new AlsaSource();
+            if(!alsa->open(*config)) {
+                delete alsa;
+                return NULL;
+            }
+            source = alsa;
+#else
+            fprintf(stderr, "ALSA capture isn't compiled in, rebuild with make ALSA=1\n");
+            return NULL;
+#endif
+        } else if(config->source != CAPTURE_SOURCE_PUSH) {
+            return NULL;
+        }
+        // exceptions can't cross into C callers, running out of memory or threads is just a failure here
+        try {
+            return reinterpret_cast<capture_t*>(new CapturePipeline(detectors, *config, source, notify, userdata));
+        } catch(...) {
+            delete source;
+            return NULL;
+        }
+    }
+    void capture_free(capture_t *capture) {
+        delete reinterpret_cast<CapturePipeline*>(capture);
+    }
+    size_t capture_write(capture_t *capture, const float *samples, size_t count, long long captureNs) {
+        return reinterpret_cast<CapturePipeline*>(capture)->write(samples, count, captureNs, false);
+    }
+    size_t capture_poll(capture_t *capture, capture_event_t *events, size_t maxEvents) {
+        return reinterpret_cast<CapturePipeline*>(capture)->poll(events, maxEvents);
+    }
+    int capture_finished(capture_t *capture) {
+        return reinterpret_cast<CapturePipeline*>(capture)->finished();
+    }
+    void capture_stats(capture_t *capture, capture_stats_t *stats) {
+        reinterpret_cast<CapturePipeline*>(capture)->stats(*stats);
+    }
+    long long capture_now_ns(void) {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
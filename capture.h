@@ -0,0 +1,230 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+// Live input for the detectors. A capture thread (or the host's own audio callback) hands periods of samples
+// through a lock-free single producer ring to a detector thread of their own, optionally pinned to a core and
+// real-time scheduled, so the audio side never waits on detection and detection never waits on anything else.
+// Events come back through a second lock-free ring that the host drains in batches, with at most one wakeup
+// outstanding however many events pile up. Every period is timestamped when its last sample was captured, so
+// the pipeline measures its own latency from there to the events being ready, and counts everything it drops.
+//
+// Sources:
+//  * CAPTURE_SOURCE_PUSH: the host calls capture_write from its audio callback, like the macOS AudioQueue
+//  * CAPTURE_SOURCE_FILE: a WAV or raw float32 file, or "-" for a pipe on stdin, for testing without hardware.
+//    Files are read as fast as the detectors keep up unless paced, in which case they're fed at the sample rate
+//    and treated like a live device.
+//  * CAPTURE_SOURCE_ALSA: an ALSA capture device, which includes PipeWire and PulseAudio through their ALSA
+//    plugins. Compiled in with -DDETECTORS_CAPTURE_ALSA (make ALSA=1), linking -lasound.
+
+#include <stddef.h>
+
+#include "detectors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAPTURE_SOURCE_PUSH 0
+#define CAPTURE_SOURCE_FILE 1
+#define CAPTURE_SOURCE_ALSA 2
+
+// the largest period the ring between the threads holds, longer writes are split up
+#define CAPTURE_MAX_PERIOD 4096
+
+typedef struct {
+    int source; // one of the CAPTURE_SOURCE_ values
+    // file path or "-" for stdin with CAPTURE_SOURCE_FILE, device name like "default" or "hw:1" with ALSA
+    const char *device;
+    // the rate the detectors were created with. Files with a header must match it.
+    int sampleRate;
+    int periodFrames; // samples per period read from the device or file (default 128, one hop)
+    int devicePeriods; // periods in the ALSA device buffer (default 3)
+    int ringPeriods; // periods the ring between the threads holds, rounded up to a power of two (default 64)
+    int cpu; // core to pin the detector thread to, -1 to leave it to the scheduler
+    int realtime; // nonzero to ask for SCHED_FIFO for the capture and detector threads, ignored if not allowed
+    int paceFile; // nonzero to feed a file at the sample rate like a live device
+    int rawFile; // nonzero if the file is headerless float32
+} capture_config_t;
+
+typedef struct {
+    int events; // what detectors_push reported for the hop
+    // like detectors_push's sample, counted from the start of the capture. Periods dropped because the ring was
+    // full still count, audio a device lost to an overrun doesn't since how much is unknown.
+    unsigned long long sample;
+    // CLOCK_MONOTONIC (steady clock) nanoseconds when the hop's last sample was captured and when its events were
+    // ready in the queue
+    long long captureNs;
+    long long detectNs;
+} capture_event_t;
+
+typedef struct {
+    unsigned long long periods; // periods processed by the detector thread
+    unsigned long long droppedPeriods; // periods thrown away because the ring was full
+    unsigned long long xruns; // overruns the device reported, each losing an unknown amount of audio
+    unsigned long long events;
+    unsigned long long droppedEvents; // events thrown away because the host wasn't draining the queue
+    unsigned long long ringHighWater; // most periods ever waiting in the ring
+    // Time from a period's last sample being captured to the detector thread finishing it, which bounds the
+    // latency of any event in it. Percentiles are to the histogram's resolution of 100us.
+    double latencyP50Ms;
+    double latencyP99Ms;
+    double latencyMaxMs;
+    int pinned; // whether the detector thread got its core
+    int realtime; // whether the threads got real-time scheduling
+} capture_stats_t;
+
+typedef void capture_t; // opaque wrapper for the C++ type
+// Called on the detector thread when events are waiting and the last notification has been answered with
+// capture_poll, so the host can schedule one drain however many events arrive before it gets to it
+typedef void (*capture_notify_fn)(void *userdata);
+
+void capture_default_config(capture_config_t *config);
+// Starts capturing into newly created detectors at config->sampleRate, which must outlive the capture and get
+// no other input. Other threads can keep calling detectors_set_config on them. notify may be NULL for hosts that
+// just poll. Returns NULL if the source can't be opened.
+capture_t *capture_new(detectors_t *detectors, const capture_config_t *config, capture_notify_fn notify, void *userdata);
+// Stops the threads, waiting for a read from the source already in progress. Events still queued are lost.
+void capture_free(capture_t *capture);
+// CAPTURE_SOURCE_PUSH only, from one thread at a time: queues samples captured up to captureNs (0 for now).
+// Returns how many samples were queued, the rest were dropped because the ring was full.
+size_t capture_write(capture_t *capture, const float *samples, size_t count, long long captureNs);
+// Takes up to maxEvents events off the queue, returning how many. Only one thread may poll. A notification only
+// comes for events arriving after the last poll, so keep polling while it fills the array.
+size_t capture_poll(capture_t *capture, capture_event_t *events, size_t maxEvents);
+// Nonzero once a file has been read to the end and every period of it processed, or the device failed
+int capture_finished(capture_t *capture);
+// Readable from any thread
+void capture_stats(capture_t *capture, capture_stats_t *stats);
+// CLOCK_MONOTONIC nanoseconds, the clock the timestamps are on
+long long capture_now_ns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+#include <atomic>
+#include <thread>
+
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
+// Where the audio comes from, read by the capture thread
+class CaptureSource {
+public:
+    virtual ~CaptureSource() {}
+    // Reads up to count samples, blocking until at least one is available. Sets captureNs to when the last one
+    // was captured. Returns 0 at the end of a file and -1 if the device failed.
+    virtual long read(float *samples, size_t count, long long &captureNs) = 0;
+    // whether waiting for room in the ring is fine, rather than dropping periods to keep up like a device must
+    virtual bool canWait() const = 0;
+    virtual unsigned long long xruns() const { return 0; }
+};
+
+// Counting semaphore the detector thread sleeps on while the ring is empty
+class Wakeup {
+public:
+    Wakeup();
+    ~Wakeup();
+    void post();
+    void wait();
+private:
+    Wakeup(const Wakeup &);
+    Wakeup &operator=(const Wakeup &);
+#if defined(__APPLE__)
+    dispatch_semaphore_t m_sem;
+#else
+    sem_t m_sem;
+#endif
+};
+
+class CapturePipeline {
+public:
+    static const int kLatencyBuckets = 1000; // 100us each, the last also counts everything slower
+    static const size_t kEventQueueSize = 1024;
+
+    CapturePipeline(detectors_t *detectors, const capture_config_t &config, CaptureSource *source,
+                    capture_notify_fn notify, void *userdata);
+    ~CapturePipeline();
+    // the rings' indices are on cache lines of their own, which plain new doesn't align for before C++17
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+
+    size_t write(const float *samples, size_t count, long long captureNs, bool wait);
+    size_t poll(capture_event_t *events, size_t maxEvents);
+    bool finished() const { return m_finished.load(std::memory_order_acquire); }
+    void stats(capture_stats_t &stats) const;
+
+private:
+    CapturePipeline(const CapturePipeline &);
+    CapturePipeline &operator=(const CapturePipeline &);
+
+    // Per period bookkeeping, the samples themselves live in one buffer with periodFrames for each slot
+    struct Period {
+        size_t count;
+        long long captureNs; // when the last sample was captured
+        unsigned long long skippedBefore; // samples dropped since the period before it
+    };
+
+    void stop();
+    void captureLoop();
+    void detectLoop();
+    void processPeriod(const float *samples, const Period &period);
+    static void collectEvent(void *userdata, int events, unsigned long long sample);
+
+    detectors_t *m_detectors;
+    capture_config_t m_config;
+    CaptureSource *m_source; // NULL for CAPTURE_SOURCE_PUSH
+    capture_notify_fn m_notify;
+    void *m_userdata;
+    double m_nsPerSample;
+
+    // Ring of periods from the capture thread (or capture_write) to the detector thread
+    float *m_ringSamples;
+    Period *m_ringPeriods;
+    size_t m_periodMask;
+    alignas(64) std::atomic<size_t> m_periodHead; // next period to process, written by the detector thread
+    alignas(64) std::atomic<size_t> m_periodTail; // next free period, written by the producer
+    Wakeup m_wakeup;
+
+    // Ring of events from the detector thread to the host
+    capture_event_t m_eventRing[kEventQueueSize];
+    alignas(64) std::atomic<size_t> m_eventHead; // written by the host
+    alignas(64) std::atomic<size_t> m_eventTail; // written by the detector thread
+    std::atomic<bool> m_notifyPending;
+
+    unsigned long long m_droppedSamples; // producer state, since the last period that made it into the ring
+
+    // Detector thread state. The samples pushed so far map event samples back to the capture times of periods,
+    // and the ones skipped over dropped periods map them back to the whole capture.
+    unsigned long long m_samplesPushed;
+    unsigned long long m_samplesSkipped;
+    long long m_currentCaptureNs; // of the period being pushed, for collectEvent
+    unsigned long long m_currentEnd; // samples pushed once it's done
+    size_t m_eventWrite; // where collectEvent puts the next event, published with m_eventTail after each period
+
+    // Counters, written by one thread each and read by anyone through stats
+    alignas(64) std::atomic<unsigned long long> m_processed;
+    std::atomic<unsigned long long> m_eventCount;
+    std::atomic<unsigned long long> m_droppedEvents;
+    std::atomic<unsigned long long> m_latency[kLatencyBuckets];
+    std::atomic<long long> m_latencyMaxNs;
+    alignas(64) std::atomic<unsigned long long> m_droppedPeriods;
+    std::atomic<unsigned long long> m_highWater;
+    std::atomic<bool> m_pinned;
+    std::atomic<bool> m_realtime;
+
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_captureDone; // the source has nothing more to give
+    std::atomic<bool> m_finished;
+    std::thread m_captureThread;
+    std::thread m_detectThread;
+};
+
+#endif
+
+#endif
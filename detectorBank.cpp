@@ -0,0 +1,266 @@
+#include "detectorBank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+#include "detectorsCommon.h"
+#include "simd.h"
+
+static const int kLaneWidth = 4;
+
+DetectorBank::DetectorBank(int channels) {
+    m_channels = max(channels, 0);
+    m_lanes = (m_channels + kLaneWidth - 1) / kLaneWidth * kLaneWidth;
+
+    m_overlap.resize(m_channels * kBlockSize * 2, 0.0f);
+#if defined(DETECTORS_FFT_BUILTIN)
+    m_silence.resize(kBlockSize, 0.0f);
+#else
+    m_fftReal.resize(kSpectrumSize);
+    m_fftImag.resize(kSpectrumSize);
+#endif
+
+    // === Tss Detection
+    m_tssParams = tssDefaultParams();
+    m_tssStep = tssStepFor(m_tssParams);
+    m_lowPassWeight = kDefaultLowPassWeight;
+    m_spectrum.resize(kSpectrumSize * m_lanes, 0.0f);
+    m_lowPass.resize(kSpectrumSize * m_lanes, 0.0f);
+    m_tss.resize(m_channels);
+    for(int ch = 0; ch < m_channels; ++ch) tssReset(m_tss[ch]);
+    m_discarded.resize(m_lanes, 0);
+
+    // === Pop detection
+    popTemplateTable();
+    m_popHistory.resize(2 * kBufferWidth * kBufferHeight * m_lanes, 0.0f);
+    m_heldColumn.resize(kBufferHeight * m_lanes, 0.0f);
+    m_popCursor = 0;
+    m_popMax.resize(m_lanes);
+    for(int lane = 0; lane < m_lanes; ++lane) m_popMax[lane].reset();
+    m_framesSincePop.resize(m_lanes, 0);
+    m_maxShiftDown = kDefaultPopShiftDown;
+    m_maxShiftUp = kDefaultPopShiftUp;
+    m_popSensitivity = kDefaultPopSensitivity;
+
+    m_bands.resize(3 * m_lanes, 0.0f);
+    m_highSum.resize(m_lanes, 0.0);
+    m_invMax.resize(m_lanes, 0.0f);
+}
+
+void DetectorBank::process(const float *const *blocks, int *results) {
+    for(int ch = 0; ch < m_channels; ++ch) {
+        float *overlap = &m_overlap[ch * kBlockSize * 2];
+        std::copy(overlap+kBlockSize, overlap+(kBlockSize*2), overlap);
+        std::copy(blocks[ch], blocks[ch]+kBlockSize, overlap+kBlockSize);
+        results[ch] = 0;
+    }
+    for(int step = 0; step < kNumSteps; ++step) {
+        processHop(step, results);
+    }
+}
+
+void DetectorBank::processHop(int step, int *results) {
+    const int lanes = m_lanes;
+
+#if defined(DETECTORS_FFT_BUILTIN)
+    // 4 channels per batched FFT, writing the power spectra straight into their lanes
+    for(int g = 0; g < lanes; g += kLaneWidth) {
+        const float *inputs[kLaneWidth];
+        for(int l = 0; l < kLaneWidth; ++l) {
+            int ch = g + l;
+            inputs[l] = ch < m_channels ? &m_overlap[ch * kBlockSize * 2 + (step+1)*kStepSize] : &m_silence[0];
+        }
+        m_fft.power(inputs, &m_spectrum[g], lanes);
+    }
+#else
+    // The FFT runs a channel at a time with the shared plan, scattering the power spectrum into its lane
+    for(int ch = 0; ch < m_channels; ++ch) {
+        m_fft.forward(&m_overlap[ch * kBlockSize * 2 + (step+1)*kStepSize], &m_fftReal[0], &m_fftImag[0]);
+        for(int i = 0; i < kSpectrumSize; ++i) {
+            m_spectrum[i*lanes + ch] = m_fftReal[i] * m_fftReal[i] + m_fftImag[i] * m_fftImag[i];
+        }
+    }
+#endif
+
+    // Everything from here on is a lane loop over all channels
+    const vec4 keep = vec4_set1(1.0f - m_lowPassWeight);
+    const vec4 weight = vec4_set1(m_lowPassWeight);
+    for(int g = 0; g < lanes; g += kLaneWidth) {
+        vec4 peak = vec4_set1(0.0f);
+        for(int i = 0; i < kSpectrumSize; ++i) {
+            float *lp = &m_lowPass[i*lanes + g];
+            vec4 v = vec4_add(vec4_mul(vec4_load(lp), keep), vec4_mul(vec4_load(&m_spectrum[i*lanes + g]), weight));
+            vec4_store(lp, v);
+            peak = vec4_max(peak, v);
+        }
+        // same as Detectors: infinities mean glitchy input, so reset the low pass and throw the hop away
+        float peaks[kLaneWidth];
+        vec4_store(peaks, peak);
+        for(int l = 0; l < kLaneWidth; ++l) {
+            m_discarded[g+l] = peaks[l] >= numeric_limits<float>::infinity();
+            if(!m_discarded[g+l]) continue;
+            for(int i = 0; i < kSpectrumSize; ++i) m_lowPass[i*lanes + g + l] = 0.0f;
+        }
+    }
+
+    const size_t bandLow[3] = {kLowerBandLow, kMainBandLow, kUpperBandLo};
+    const size_t bandHi[3] = {kLowerBandHi, kMainBandHi, kUpperBandHi};
+    for(int b = 0; b < 3; ++b) {
+        float *band = &m_bands[b*lanes];
+        for(int g = 0; g < lanes; g += kLaneWidth) {
+            vec4 sum = vec4_set1(0.0f);
+            for(size_t i = bandLow[b]; i < bandHi[b]; ++i) {
+                sum = vec4_add(sum, vec4_load(&m_lowPass[i*lanes + g]));
+            }
+            vec4_store(band + g, sum);
+        }
+        // divide rather than multiply by the reciprocal so the averages match Detectors::avgBand exactly
+        for(int lane = 0; lane < lanes; ++lane) band[lane] /= (bandHi[b] - bandLow[b]);
+    }
+    for(int ch = 0; ch < m_channels; ++ch) {
+        if(m_discarded[ch]) continue;
+        results[ch] |= m_tssStep(m_tss[ch], m_tssParams, m_bands[ch], m_bands[lanes + ch], m_bands[2*lanes + ch]);
+    }
+
+    pushPopColumns();
+    scorePops(results);
+}
+
+void DetectorBank::pushPopColumns() {
+    const int lanes = m_lanes;
+    const int rowSize = kBufferHeight * lanes;
+    float *row = &m_popHistory[m_popCursor * rowSize];
+    bool anyDiscarded = false;
+    for(int lane = 0; lane < lanes; ++lane) {
+        if(!m_discarded[lane]) continue;
+        holdPopWindow(lane);
+        anyDiscarded = true;
+    }
+
+    std::copy(m_spectrum.begin(), m_spectrum.begin() + kBufferPrimaryHeight*lanes, row);
+    // high frequencies aren't useful so we bin them all together, in double like Detectors does
+    std::fill(m_highSum.begin(), m_highSum.end(), 0.0);
+    for(int i = kBufferPrimaryHeight; i < kSpectrumSize; ++i) {
+        const float *bin = &m_spectrum[i*lanes];
+        for(int lane = 0; lane < lanes; ++lane) m_highSum[lane] += bin[lane];
+    }
+    float *collapsed = row + kBufferPrimaryHeight*lanes;
+    for(int lane = 0; lane < lanes; ++lane) collapsed[lane] = static_cast<float>(m_highSum[lane]);
+    if(anyDiscarded) {
+        for(int lane = 0; lane < lanes; ++lane) {
+            if(!m_discarded[lane]) continue;
+            for(int bin = 0; bin < kBufferHeight; ++bin) row[bin*lanes + lane] = m_heldColumn[bin*lanes + lane];
+        }
+    }
+
+    for(int g = 0; g < lanes; g += kLaneWidth) {
+        vec4 colMax = vec4_load(row + g);
+        for(int bin = 1; bin < kBufferHeight; ++bin) {
+            colMax = vec4_max(colMax, vec4_load(row + bin*lanes + g));
+        }
+        float maxes[kLaneWidth];
+        vec4_store(maxes, colMax);
+        for(int l = 0; l < kLaneWidth; ++l) {
+            if(!m_discarded[g+l]) m_popMax[g+l].push(maxes[l]);
+        }
+    }
+
+    std::copy(row, row + rowSize, &m_popHistory[(m_popCursor + kBufferWidth) * rowSize]);
+    m_popCursor = (m_popCursor + 1) % kBufferWidth;
+}
+
+// Detectors pushes nothing for a discarded hop, but the shared cursor moves on for every lane. Rotating the lane's
+// ring up one slot before the write keeps its window as it was once the cursor has moved: every column goes to the
+// next slot and the newest one, from the slot the cursor is about to make the window's last, is held in
+// m_heldColumn for pushPopColumns to put back over the new column.
+void DetectorBank::holdPopWindow(int lane) {
+    const int lanes = m_lanes;
+    const int rowSize = kBufferHeight * lanes;
+    const int cursor = m_popCursor;
+    const float *newest = &m_popHistory[(cursor + kBufferWidth - 1) * rowSize + lane];
+    for(int bin = 0; bin < kBufferHeight; ++bin) m_heldColumn[bin*lanes + lane] = newest[bin*lanes];
+    for(int col = kBufferWidth - 1; col > 0; --col) {
+        int slot = (cursor + col) % kBufferWidth;
+        const float *src = &m_popHistory[(slot + kBufferWidth - 1) * rowSize + lane];
+        float *dst = &m_popHistory[slot * rowSize + lane];
+        float *mirror = &m_popHistory[(slot + kBufferWidth) * rowSize + lane];
+        for(int bin = 0; bin < kBufferHeight; ++bin) dst[bin*lanes] = mirror[bin*lanes] = src[bin*lanes];
+    }
+}
+
+// Same L1 template distance as Detectors::templateDiff, but with the 4 lanes of a vector holding 4 channels,
+// broadcasting each template cell against them. A group stops early once all its live lanes are out of reach.
+void DetectorBank::scorePops(int *results) {
+    const int lanes = m_lanes;
+    const PopTemplateTable &table = popTemplateTable();
+    const int firstShift = kPopShiftUp - m_maxShiftUp;
+    const int numShifts = m_maxShiftUp + m_maxShiftDown;
+    const float *window = &m_popHistory[m_popCursor * kBufferHeight * lanes];
+
+    bool anyLive = false;
+    for(int lane = 0; lane < lanes; ++lane) {
+        float maxVal = m_popMax[lane].max();
+        bool live = lane < m_channels && !m_discarded[lane];
+        if(live) m_framesSincePop[lane] += 1;
+        live = live && m_framesSincePop[lane] > kDefaultPopDebounceFrames &&
+               maxVal > 0.0f && maxVal < numeric_limits<float>::infinity();
+        m_invMax[lane] = live ? 1.0f / maxVal : 0.0f;
+        anyLive = anyLive || live;
+    }
+    if(!anyLive) return;
+
+    for(int g = 0; g < lanes; g += kLaneWidth) {
+        float inv[kLaneWidth];
+        std::copy(&m_invMax[g], &m_invMax[g] + kLaneWidth, inv);
+        if(inv[0] == 0.0f && inv[1] == 0.0f && inv[2] == 0.0f && inv[3] == 0.0f) continue;
+        const vec4 scale = vec4_load(inv);
+
+        vec4 acc[kNumPopShifts];
+        for(int s = 0; s < numShifts; ++s) acc[s] = vec4_set1(0.0f);
+        float minDiff[kLaneWidth];
+        for(int col = 0; col < kBufferWidth; ++col) {
+            const float *hist = window + col * kBufferHeight * lanes + g;
+            for(int bin = kPopStartBin; bin < kBufferHeight; ++bin) {
+                vec4 h = vec4_mul(vec4_load(hist + bin*lanes), scale);
+                for(int s = 0; s < numShifts; ++s) {
+                    vec4 t = vec4_set1(table.cells[firstShift+s][col][bin]);
+                    acc[s] = vec4_add(acc[s], vec4_abs(vec4_sub(t, h)));
+                }
+            }
+            if((col & 7) == 7 || col == kBufferWidth-1) {
+                vec4 best = acc[0];
+                for(int s = 1; s < numShifts; ++s) best = vec4_min(best, acc[s]);
+                vec4_store(minDiff, best);
+                bool reachable = false;
+                for(int l = 0; l < kLaneWidth; ++l) {
+                    reachable = reachable || (inv[l] != 0.0f && minDiff[l] < m_popSensitivity);
+                }
+                if(!reachable) break;
+            }
+        }
+        for(int l = 0; l < kLaneWidth; ++l) {
+            if(inv[l] != 0.0f && minDiff[l] < m_popSensitivity) {
+                results[g+l] |= POP_CODE;
+                m_framesSincePop[g+l] = 0;
+            }
+        }
+    }
+}
+
+extern "C" {
+    detector_bank_t *detector_bank_new(int channels) {
+        return reinterpret_cast<detector_bank_t*>(new DetectorBank(channels));
+    }
+    void detector_bank_free(detector_bank_t *bank) {
+        delete reinterpret_cast<DetectorBank*>(bank);
+    }
+    int detector_bank_channels(detector_bank_t *bank) {
+        return reinterpret_cast<DetectorBank*>(bank)->channels();
+    }
+    void detector_bank_process(detector_bank_t *bank, const float *const *blocks, int *results) {
+        reinterpret_cast<DetectorBank*>(bank)->process(blocks, results);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef _DETECTOR_BANK_H_
+#define _DETECTOR_BANK_H_
+
+// Runs the detectors from detectors.h over many independent mono streams at once, for example one per microphone
+// or call recording. Each call processes one DETECTORS_BLOCK_SIZE block for every channel and returns an event
+// bitmask per channel, the same events separate detectors_t instances would give. Input must already be at
+// DETECTORS_SAMPLE_RATE since the bank works on whole blocks, use detectors_t or the pool for other rates.
+// Like detectors.h it exposes a C API along with the C++ class.
+
+#include "detectors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void detector_bank_t; // opaque wrapper for the C++ type
+detector_bank_t *detector_bank_new(int channels);
+void detector_bank_free(detector_bank_t *bank);
+int detector_bank_channels(detector_bank_t *bank);
+// blocks[i] points to DETECTORS_BLOCK_SIZE samples for channel i and results[i] receives that channel's events
+void detector_bank_process(detector_bank_t *bank, const float *const *blocks, int *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+#include <vector>
+
+// All the per channel arrays are laid out structure of arrays style as [row][lane], with the channel count
+// rounded up to a multiple of 4 lanes, so the low pass, band averages and template scoring each process
+// 4 channels per SIMD instruction. With the built in FFT the transforms are batched the same way, 4 channels per
+// vector op. vDSP and FFTW have no batched form with the same output, so with them one shared plan runs a channel
+// at a time.
+class DetectorBank {
+public:
+    explicit DetectorBank(int channels);
+
+    int channels() const { return m_channels; }
+
+    void process(const float *const *blocks, int *results);
+
+private:
+    void processHop(int step, int *results);
+    void pushPopColumns();
+    void holdPopWindow(int lane);
+    void scorePops(int *results);
+
+    int m_channels;
+    int m_lanes;
+
+    // [channel][2*DETECTORS_BLOCK_SIZE], the previous block followed by the current one
+    std::vector<float> m_overlap;
+#if defined(DETECTORS_FFT_BUILTIN)
+    RealFFT4 m_fft;
+    std::vector<float> m_silence; // input for the lanes past the last channel
+#else
+    RealFFT m_fft;
+    std::vector<float> m_fftReal;
+    std::vector<float> m_fftImag;
+#endif
+
+    // Tss detection
+    TssParams m_tssParams;
+    TssStepFn m_tssStep;
+    float m_lowPassWeight;
+    std::vector<float> m_spectrum; // [bin][lane]
+    std::vector<float> m_lowPass; // [bin][lane]
+    std::vector<TssState> m_tss;
+    std::vector<char> m_discarded; // lanes whose hop was thrown away as garbage
+
+    // Pop detection
+    std::vector<float> m_popHistory; // [2*kPopHistoryWidth][bin][lane], mirrored like Detectors::m_popHistory
+    std::vector<float> m_heldColumn; // [bin][lane], see holdPopWindow
+    int m_popCursor;
+    std::vector<SlidingMax<Detectors::kPopHistoryWidth> > m_popMax;
+    std::vector<unsigned long> m_framesSincePop;
+    int m_maxShiftDown;
+    int m_maxShiftUp;
+    float m_popSensitivity;
+
+    // per lane scratch
+    std::vector<float> m_bands; // [3][lane]
+    std::vector<double> m_highSum;
+    std::vector<float> m_invMax;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,282 @@
+#include "detectorPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+static const int kBlockSize = DETECTORS_BLOCK_SIZE;
+// how many queued blocks a worker processes from a stream before giving other streams a turn
+static const int kMaxBlocksPerTurn = 8;
+static const size_t kEventQueueSize = 4096;
+
+static size_t nextPowerOfTwo(size_t n) {
+    size_t p = 1;
+    while(p < n) p <<= 1;
+    return p;
+}
+
+// ===================== Work stealing deque =================================
+
+void DetectorPool::WorkDeque::init(size_t capacity) {
+    capacity = nextPowerOfTwo(max<size_t>(capacity, 2));
+    m_items = new atomic<int>[capacity];
+    m_mask = capacity - 1;
+}
+
+void DetectorPool::WorkDeque::push(int item) {
+    long b = m_bottom.load(memory_order_relaxed);
+    m_items[b & m_mask].store(item, memory_order_relaxed);
+    m_bottom.store(b + 1, memory_order_release);
+}
+
+bool DetectorPool::WorkDeque::pop(int &item) {
+    long b = m_bottom.load(memory_order_relaxed) - 1;
+    m_bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = m_top.load(memory_order_relaxed);
+    if(t > b) {
+        m_bottom.store(b + 1, memory_order_relaxed);
+        return false;
+    }
+    item = m_items[b & m_mask].load(memory_order_relaxed);
+    if(t == b) {
+        // last item, race any thieves for it
+        bool won = m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+        m_bottom.store(b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+bool DetectorPool::WorkDeque::steal(int &item) {
+    long t = m_top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = m_bottom.load(memory_order_acquire);
+    if(t >= b) return false;
+    item = m_items[t & m_mask].load(memory_order_relaxed);
+    return m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// ===================== Pool =================================
+
+DetectorPool::DetectorPool(int streams, int threads, int queueBlocks, int sampleRate)
+    : m_detectors(NULL), m_events(NULL), m_eventMask(kEventQueueSize - 1), m_eventTail(0), m_eventHead(0),
+      m_dropped(0), m_running(true) {
+    if(threads <= 0) threads = max(1u, thread::hardware_concurrency());
+    m_queueBlocks = nextPowerOfTwo(max(queueBlocks, 2));
+    m_streams.resize(max(streams, 0), NULL);
+    m_workers.resize(threads, NULL);
+
+    // anything failing part way, allocations or starting threads, undoes whatever had been set up
+    try {
+        if(posix_memalign(&m_detectors, DETECTORS_ALIGNMENT, max(m_streams.size(), size_t(1)) * detectors_size()) != 0) {
+            m_detectors = NULL;
+            throw bad_alloc();
+        }
+        for(size_t i = 0; i < m_streams.size(); ++i) {
+            Stream *stream = new Stream();
+            stream->detectors = NULL;
+            m_streams[i] = stream;
+            stream->blocks.resize(m_queueBlocks * kBlockSize);
+            stream->head.store(0);
+            stream->tail.store(0);
+            stream->scheduled.store(false);
+            stream->blockIndex = 0;
+            void *mem = static_cast<char*>(m_detectors) + i * detectors_size();
+            stream->detectors = reinterpret_cast<Detectors*>(detectors_init_in(mem, sampleRate, NULL, NULL));
+        }
+
+        m_events = new EventCell[kEventQueueSize];
+        for(size_t i = 0; i < kEventQueueSize; ++i) m_events[i].sequence.store(i, memory_order_relaxed);
+
+        for(int i = 0; i < threads; ++i) {
+            m_workers[i] = new Worker();
+            m_workers[i]->deque.init(m_streams.size());
+            m_workers[i]->processed.store(0);
+        }
+        for(int i = 0; i < threads; ++i) {
+            m_workers[i]->thread = thread(&DetectorPool::run, this, i);
+        }
+    } catch(...) {
+        release();
+        throw;
+    }
+}
+
+DetectorPool::~DetectorPool() {
+    release();
+}
+
+void DetectorPool::release() {
+    m_running.store(false);
+    // every worker has to stop before any deque goes away since they steal from each other
+    for(size_t i = 0; i < m_workers.size(); ++i) {
+        if(m_workers[i] && m_workers[i]->thread.joinable()) m_workers[i]->thread.join();
+    }
+    for(size_t i = 0; i < m_workers.size(); ++i) delete m_workers[i];
+    for(size_t i = 0; i < m_streams.size(); ++i) {
+        if(m_streams[i] && m_streams[i]->detectors) detectors_deinit(m_streams[i]->detectors);
+        delete m_streams[i];
+    }
+    free(m_detectors);
+    delete[] m_events;
+}
+
+bool DetectorPool::push(int index, const float *block) {
+    Stream *stream = m_streams[index];
+    size_t tail = stream->tail.load(memory_order_relaxed);
+    if(tail - stream->head.load(memory_order_acquire) >= m_queueBlocks) return false;
+    std::copy(block, block + kBlockSize, &stream->blocks[(tail & (m_queueBlocks - 1)) * kBlockSize]);
+    stream->tail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+int DetectorPool::poll(detector_pool_event_t *events, int maxEvents) {
+    int count = 0;
+    while(count < maxEvents) {
+        EventCell &cell = m_events[m_eventHead & m_eventMask];
+        if(cell.sequence.load(memory_order_acquire) != m_eventHead + 1) break;
+        events[count++] = cell.event;
+        cell.sequence.store(m_eventHead + kEventQueueSize, memory_order_release);
+        m_eventHead += 1;
+    }
+    return count;
+}
+
+unsigned long long DetectorPool::processed() const {
+    unsigned long long total = 0;
+    for(size_t i = 0; i < m_workers.size(); ++i) total += m_workers[i]->processed.load(memory_order_acquire);
+    return total;
+}
+
+void DetectorPool::emit(const detector_pool_event_t &event) {
+    size_t pos = m_eventTail.load(memory_order_relaxed);
+    while(true) {
+        EventCell &cell = m_events[pos & m_eventMask];
+        size_t seq = cell.sequence.load(memory_order_acquire);
+        long diff = static_cast<long>(seq - pos);
+        if(diff == 0) {
+            if(m_eventTail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                cell.event = event;
+                cell.sequence.store(pos + 1, memory_order_release);
+                return;
+            }
+        } else if(diff < 0) {
+            // the consumer is a whole queue behind, dropping is better than stalling the audio
+            m_dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        } else {
+            pos = m_eventTail.load(memory_order_relaxed);
+        }
+    }
+}
+
+// Claims a stream that has input waiting and isn't already owned by another worker
+bool DetectorPool::claimReady(int index) {
+    Stream *stream = m_streams[index];
+    if(stream->head.load(memory_order_relaxed) == stream->tail.load(memory_order_acquire)) return false;
+    bool expected = false;
+    return stream->scheduled.compare_exchange_strong(expected, true, memory_order_acquire, memory_order_relaxed);
+}
+
+// Processes up to kMaxBlocksPerTurn queued blocks of a claimed stream then releases it, returning how many ran
+int DetectorPool::processStream(int index) {
+    Stream *stream = m_streams[index];
+    size_t head = stream->head.load(memory_order_relaxed);
+    size_t tail = stream->tail.load(memory_order_acquire);
+    size_t end = min(tail, head + kMaxBlocksPerTurn);
+    int count = static_cast<int>(end - head);
+    for(; head != end; ++head) {
+        int result = stream->detectors->process(&stream->blocks[(head & (m_queueBlocks - 1)) * kBlockSize]);
+        if(result) {
+            detector_pool_event_t event = {index, result, stream->blockIndex};
+            emit(event);
+        }
+        stream->blockIndex += 1;
+        // hand the slot back to the producer as soon as it's consumed
+        stream->head.store(head + 1, memory_order_release);
+    }
+    stream->scheduled.store(false, memory_order_release);
+    return count;
+}
+
+void DetectorPool::run(int index) {
+    Worker &self = *m_workers[index];
+    const int numWorkers = static_cast<int>(m_workers.size());
+    const int numStreams = static_cast<int>(m_streams.size());
+    // claim at most a fair share of other workers' streams in one sweep, so the rest stay for whoever's idle next
+    const int sweepLimit = numStreams / numWorkers + 1;
+    int idleRounds = 0;
+    unsigned victim = index;
+    int sweepStart = index;
+    while(m_running.load(memory_order_relaxed)) {
+        int stream;
+        if(!self.deque.pop(stream)) {
+            // refill from the streams this worker is home to, then try to take work from someone else
+            for(int s = index; s < numStreams; s += numWorkers) {
+                if(claimReady(s)) self.deque.push(s);
+            }
+            if(!self.deque.pop(stream)) {
+                bool stolen = false;
+                for(int tries = 1; tries < numWorkers && !stolen; ++tries) {
+                    victim = (victim + 1) % numWorkers;
+                    if(victim != static_cast<unsigned>(index)) stolen = m_workers[victim]->deque.steal(stream);
+                }
+                if(!stolen) {
+                    // Nothing queued anywhere, but streams whose home worker is busy processing aren't in any deque
+                    // yet, so claim ready ones from every shard. They go in this worker's deque where the other
+                    // idle workers can steal them.
+                    int claimed = 0;
+                    for(int k = 0; k < numStreams && claimed < sweepLimit; ++k) {
+                        int s = (sweepStart + k) % numStreams;
+                        if(claimReady(s)) {
+                            self.deque.push(s);
+                            claimed += 1;
+                        }
+                    }
+                    if(numStreams) sweepStart = (sweepStart + max(claimed, 1)) % numStreams;
+                    stolen = claimed > 0 && self.deque.pop(stream);
+                }
+                if(!stolen) {
+                    // back off gently so idle workers don't burn a core each
+                    idleRounds = min(idleRounds + 1, 10);
+                    if(idleRounds < 4) this_thread::yield();
+                    else this_thread::sleep_for(chrono::microseconds(1 << idleRounds));
+                    continue;
+                }
+            }
+        }
+        idleRounds = 0;
+        self.processed.fetch_add(processStream(stream), memory_order_release);
+    }
+}
+
+extern "C" {
+    detector_pool_t *detector_pool_new(int streams, int threads, int queueBlocks, int sampleRate) {
+        if(!Resampler::supported(sampleRate, DETECTORS_SAMPLE_RATE)) return NULL;
+        // exceptions can't cross into C callers, running out of memory or threads is just a failure here
+        try {
+            return reinterpret_cast<detector_pool_t*>(new DetectorPool(streams, threads, queueBlocks, sampleRate));
+        } catch(...) {
+            return NULL;
+        }
+    }
+    void detector_pool_free(detector_pool_t *pool) {
+        delete reinterpret_cast<DetectorPool*>(pool);
+    }
+    int detector_pool_push(detector_pool_t *pool, int stream, const float *block) {
+        return reinterpret_cast<DetectorPool*>(pool)->push(stream, block) ? 1 : 0;
+    }
+    int detector_pool_poll(detector_pool_t *pool, detector_pool_event_t *events, int maxEvents) {
+        return reinterpret_cast<DetectorPool*>(pool)->poll(events, maxEvents);
+    }
+    unsigned long long detector_pool_processed(detector_pool_t *pool) {
+        return reinterpret_cast<DetectorPool*>(pool)->processed();
+    }
+    unsigned long long detector_pool_dropped(detector_pool_t *pool) {
+        return reinterpret_cast<DetectorPool*>(pool)->dropped();
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef _DETECTOR_POOL_H_
+#define _DETECTOR_POOL_H_
+
+// Runs many independent detector streams on a pool of worker threads. Each stream has its own Detectors
+// instance fed through a lock-free single producer ring of blocks, streams are spread over the workers with
+// work stealing, and the events from every stream come back through one lock-free queue. Every worker is home
+// to a shard of the streams, but a worker with nothing to do steals queued streams from the others' deques and
+// claims ready streams from any shard whose home worker is busy.
+// A stream is only ever processed by one worker at a time, so its blocks are always processed in order.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int stream;
+    int events; // bitmask of TSS_START_CODE, TSS_STOP_CODE and POP_CODE
+    unsigned long long block; // index of the block within its stream that produced the events
+} detector_pool_event_t;
+
+typedef void detector_pool_t; // opaque wrapper for the C++ type
+// threads <= 0 uses one worker per core, queueBlocks is how many blocks each stream can have waiting.
+// Every stream is at sampleRate, returns NULL if detectors_new wouldn't support it or the pool can't be set up.
+detector_pool_t *detector_pool_new(int streams, int threads, int queueBlocks, int sampleRate);
+void detector_pool_free(detector_pool_t *pool);
+// Copies one DETECTORS_BLOCK_SIZE block into a stream's queue. Each stream must only be pushed to from one
+// thread at a time. Returns 0 without copying if the stream's queue is full.
+int detector_pool_push(detector_pool_t *pool, int stream, const float *block);
+// Takes up to maxEvents events off the output queue, returning how many were written. Single consumer.
+int detector_pool_poll(detector_pool_t *pool, detector_pool_event_t *events, int maxEvents);
+// Total blocks processed so far over all streams
+unsigned long long detector_pool_processed(detector_pool_t *pool);
+// Events thrown away because the output queue was full
+unsigned long long detector_pool_dropped(detector_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "detectors.h"
+
+class DetectorPool {
+public:
+    // sampleRate must be one the detectors support
+    DetectorPool(int streams, int threads, int queueBlocks, int sampleRate);
+    ~DetectorPool();
+
+    bool push(int stream, const float *block);
+    int poll(detector_pool_event_t *events, int maxEvents);
+    unsigned long long processed() const;
+    unsigned long long dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    DetectorPool(const DetectorPool &);
+    DetectorPool &operator=(const DetectorPool &);
+
+    // Lock-free ring of blocks with one producer and whichever worker currently owns the stream as consumer
+    struct Stream {
+        Detectors *detectors; // in m_detectors
+        std::vector<float> blocks;
+        std::atomic<size_t> head; // next block to process, written by the owning worker
+        std::atomic<size_t> tail; // next free slot, written by the producer
+        std::atomic<bool> scheduled; // claimed by a worker, either queued in a deque or being processed
+        unsigned long long blockIndex;
+    };
+
+    // Chase-Lev work stealing deque of stream indices. Only its worker pushes and pops at the bottom, any thread
+    // can steal from the top. A stream is in at most one deque at a time so capacity >= streams never overflows.
+    class WorkDeque {
+    public:
+        WorkDeque() : m_items(NULL), m_mask(0), m_top(0), m_bottom(0) {}
+        ~WorkDeque() { delete[] m_items; }
+        void init(size_t capacity);
+        void push(int item);
+        bool pop(int &item);
+        bool steal(int &item);
+    private:
+        std::atomic<int> *m_items;
+        size_t m_mask;
+        std::atomic<long> m_top;
+        std::atomic<long> m_bottom;
+    };
+
+    // Bounded multi producer queue (Vyukov's sequence number design) carrying events to the single consumer
+    struct EventCell {
+        std::atomic<size_t> sequence;
+        detector_pool_event_t event;
+    };
+
+    struct Worker {
+        WorkDeque deque;
+        std::thread thread;
+        std::atomic<unsigned long long> processed;
+    };
+
+    void release();
+    void run(int index);
+    bool claimReady(int stream);
+    int processStream(int stream);
+    void emit(const detector_pool_event_t &event);
+
+    size_t m_queueBlocks;
+    std::vector<Stream*> m_streams;
+    // every stream's detectors side by side in one block, so creating a pool is one allocation however many
+    // streams it has
+    void *m_detectors;
+    std::vector<Worker*> m_workers;
+    EventCell *m_events;
+    size_t m_eventMask;
+    std::atomic<size_t> m_eventTail;
+    size_t m_eventHead;
+    std::atomic<unsigned long long> m_dropped;
+    std::atomic<bool> m_running;
+};
+
+#endif
+
+#endif
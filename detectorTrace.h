@@ -0,0 +1,139 @@
+#ifndef _DETECTOR_TRACE_H_
+#define _DETECTOR_TRACE_H_
+
+// Optional instrumentation of the detectors, compiled in with -DDETECTORS_TRACE (make TRACE=1).
+// Every hop then records how long each stage took along with the features the detectors decided on into a
+// preallocated lock-free ring, which another thread drains with detectors_trace_drain. The processing thread
+// never allocates or waits, when the ring is full records are dropped and counted instead.
+// Without DETECTORS_TRACE none of this is compiled into the detectors and draining always returns nothing.
+//
+// Trace files written by popclick-bench --trace are a header of four little endian uint32s: the magic
+// DETECTORS_TRACE_MAGIC, DETECTORS_TRACE_VERSION, sizeof(detectors_trace_record_t) and the sample rate the
+// sample positions are in, followed by the records exactly as laid out below.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DETECTORS_TRACE_MAGIC 0x52544350 // "PCTR"
+#define DETECTORS_TRACE_VERSION 1
+
+// The stages of a hop that get timed, in order
+#define DETECTORS_TRACE_FFT 0 // with DETECTORS_ENGINE_FILTERBANK also the transient gate, and 0 while it's closed
+#define DETECTORS_TRACE_SPECTRUM 1 // power spectrum and low pass, or the filterbank
+#define DETECTORS_TRACE_BANDS 2 // band averages and the "sss" state machine
+#define DETECTORS_TRACE_POP 3 // pop history update and template scoring
+#define DETECTORS_TRACE_STAGES 4
+
+typedef struct {
+    // samples at DETECTORS_SAMPLE_RATE processed up to the end of this hop
+    unsigned long long sample;
+    // time spent in each stage, in ticks of the cheapest fine grained counter: the TSC on x86, the virtual
+    // counter on ARM64 and nanoseconds elsewhere
+    unsigned int ticks[DETECTORS_TRACE_STAGES];
+    float lowerBand;
+    float mainBand;
+    float upperBand;
+    float matchiness;
+    // what the "sss" state machine did: 0.0002 no match, 0.01 matching, 1 started, 2 stopped. 0 when the hop was
+    // thrown away as garbage (infinities in its spectrum or bands), the other features are then 0 too.
+    float debugMarker;
+    // smallest template distance over all shifts and templates, negative when there was nothing to score this hop.
+    // Scoring is skipped or stops early once no shift can match, so anything >= the pop sensitivity is only a
+    // lower bound.
+    float minDiff;
+    int events;
+    int reserved;
+} detectors_trace_record_t;
+
+// detectors_t is declared in detectors.h, repeated here so this header stands on its own. C before C11 doesn't
+// allow declaring a typedef twice, so whichever header comes first declares it.
+#ifndef DETECTORS_T_DEFINED
+#define DETECTORS_T_DEFINED
+typedef void detectors_t;
+#endif
+// Copies up to maxRecords of the oldest records out of the ring, returning how many. Only one thread may drain.
+size_t detectors_trace_drain(detectors_t *detectors, detectors_trace_record_t *records, size_t maxRecords);
+// How many records were thrown away because the ring was full
+unsigned long long detectors_trace_dropped(detectors_t *detectors);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+#include <atomic>
+
+#ifdef DETECTORS_TRACE
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <x86intrin.h>
+#elif !defined(__aarch64__)
+#include <chrono>
+#endif
+
+static inline unsigned long long traceTicks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+#endif
+
+// Timestamps the stage boundaries of a hop, empty and free when tracing is compiled out
+struct HopTimer {
+#ifdef DETECTORS_TRACE
+    unsigned long long stamps[DETECTORS_TRACE_STAGES + 1];
+    void mark(int boundary) { stamps[boundary] = traceTicks(); }
+#else
+    void mark(int) {}
+#endif
+};
+
+// Single producer single consumer ring of trace records, inline so tracing doesn't allocate either
+class TraceRing {
+public:
+    static const size_t kCapacity = 4096; // about 12 seconds of hops, must be a power of two
+
+    TraceRing() : m_mask(kCapacity - 1), m_head(0), m_tail(0), m_dropped(0) {}
+
+    void push(const detectors_trace_record_t &record) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if(tail - m_head.load(std::memory_order_acquire) > m_mask) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_records[tail & m_mask] = record;
+        m_tail.store(tail + 1, std::memory_order_release);
+    }
+
+    size_t drain(detectors_trace_record_t *records, size_t maxRecords) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t available = m_tail.load(std::memory_order_acquire) - head;
+        size_t n = available < maxRecords ? available : maxRecords;
+        for(size_t i = 0; i < n; ++i) records[i] = m_records[(head + i) & m_mask];
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    unsigned long long dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    detectors_trace_record_t m_records[kCapacity];
+    size_t m_mask;
+    std::atomic<size_t> m_head; // next record to drain, written by the reader
+    std::atomic<size_t> m_tail; // next free slot, written by the processing thread
+    std::atomic<unsigned long long> m_dropped;
+};
+
+#endif
+
+#endif
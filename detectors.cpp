@@ -5,215 +5,433 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <cstring>
+#include <cstdlib>
+#include <new>
 
 using namespace std;
 
-#include "poptemplate.h"
+#include "detectorsCommon.h"
+#include "simd.h"
+
+PopTemplateTable::PopTemplateTable(const float *templ, float templMax) {
+    memset(cells, 0, sizeof(cells));
+    for(int s = 0; s < kNumPopShifts; ++s) {
+        int shift = s - kPopShiftUp;
+        for(int col = 0; col < kBufferWidth; ++col) {
+            const float *column = templ + col*kBufferHeight;
+            for(int bin = kPopStartBin; bin < kBufferPrimaryHeight; ++bin) {
+                if(bin+shift >= 0 && bin+shift < kBufferPrimaryHeight) {
+                    cells[s][col][bin] = column[bin+shift]/templMax;
+                }
+            }
+            // the collapsed high frequency bin isn't shifted
+            for(int bin = kBufferPrimaryHeight; bin < kBufferHeight; ++bin) {
+                cells[s][col][bin] = column[bin]/templMax;
+            }
+            columnSums[s][col] = accumulate(cells[s][col], cells[s][col]+kPopStride, 0.0f);
+        }
+    }
+}
 
-static const bool kDelayMatch = false;
+const PopTemplateTable &popTemplateTable() {
+    static const PopTemplateTable table(kPopTemplate, kPopTemplateMax);
+    return table;
+}
 
-static const int kBlockSize = DETECTORS_BLOCK_SIZE;
-static const int kLogBlockSize = 9;
-static const int kSpectrumSize = kBlockSize/2;
-static const int kWindowSize = kBlockSize;
+void popShiftRange(int maxShiftUp, int maxShiftDown, PopTemplate &templ) {
+    int up = std::min(std::max(maxShiftUp, 0), kPopShiftUp);
+    int down = std::min(std::max(maxShiftDown, 1), kPopShiftDown);
+    templ.firstShift = kPopShiftUp - up;
+    templ.numShifts = up + down;
+}
 
-static const int kNumSteps = 4;
-static const int kStepSize = kBlockSize / kNumSteps;
+TssParams tssDefaultParams() {
+    TssParams params;
+    params.sensitivity = 5.0;
+    params.hysterisisFactor = 0.4;
+    params.minFrames = 20;
+    params.minFramesLong = 100;
+    params.delayMatch = false;
+    return params;
+}
 
-static const size_t kMainBandLow = 40;
-static const size_t kMainBandHi = 100;
-static const size_t kOptionalBandHi = 180;
+void tssReset(TssState &state) {
+    state.savedOtherBands = 0.0002;
+    state.consecutiveMatches = 0;
+    state.framesSinceSpeech = 1000;
+    state.framesSinceMatch = 1000;
+}
 
-static const size_t kLowerBandLow = 3;
-static const size_t kLowerBandHi = kMainBandLow;
-static const size_t kUpperBandLo = kOptionalBandHi;
-static const size_t kUpperBandHi = kSpectrumSize;
+template<bool DelayMatch>
+static int tssStep(TssState &state, const TssParams &params, float lowerBand, float mainBand, float upperBand) {
+    int result = 0;
 
-static const float kDefaultLowPassWeight = 0.6;
-static const int kSpeechShadowTime = 100;
-static const float kSpeechThresh = 0.5;
+    state.framesSinceSpeech += 1;
+    if(lowerBand > kSpeechThresh) {
+        state.framesSinceSpeech = 0;
+    }
 
-Detectors::Detectors() {
-    m_overlapBuffer = new float[kBlockSize * 2];
+    float debugMarker = 0.0002;
+    float matchiness = mainBand / ((lowerBand+upperBand)/2.0f);
+    bool outOfShadow = state.framesSinceSpeech > kSpeechShadowTime;
+    int immediateMatchFrame = DelayMatch ? params.minFramesLong : params.minFrames;
+    state.framesSinceMatch += 1;
+    if(((matchiness >= params.sensitivity) ||
+        (state.consecutiveMatches > 0 && matchiness >= params.sensitivity*params.hysterisisFactor) ||
+        (state.consecutiveMatches > immediateMatchFrame && (mainBand/state.savedOtherBands) >= params.sensitivity*params.hysterisisFactor*0.5f))
+     && outOfShadow) {
+        debugMarker = 0.01;
+        // second one in double "tss" came earlier than trigger timer
+        if(DelayMatch && state.consecutiveMatches == 0 && state.framesSinceMatch <= params.minFramesLong) {
+            result |= TSS_START_CODE;
+            result |= TSS_STOP_CODE;
+            state.framesSinceMatch = 1000;
+        }
+
+        state.consecutiveMatches += 1;
+        if(DelayMatch && state.consecutiveMatches == params.minFrames) {
+            state.framesSinceMatch = state.consecutiveMatches;
+        } else if(state.consecutiveMatches == immediateMatchFrame) {
+            debugMarker = 1.0;
+            result |= TSS_START_CODE;
+            state.savedOtherBands = ((lowerBand+upperBand)/2.0f);
+        }
+    } else {
+        bool delayedMatch = DelayMatch && (state.framesSinceMatch == params.minFramesLong && outOfShadow);
+        if(delayedMatch) {
+            result |= TSS_START_CODE;
+        }
+        if(state.consecutiveMatches >= immediateMatchFrame || delayedMatch) {
+            debugMarker = 2.0;
+            result |= TSS_STOP_CODE;
+        }
+        state.consecutiveMatches = 0;
+    }
+
+#ifdef DETECTORS_TRACE
+    state.matchiness = matchiness;
+    state.debugMarker = debugMarker;
+#endif
+    return result;
+}
 
+TssStepFn tssStepFor(const TssParams &params) {
+    return params.delayMatch ? tssStep<true> : tssStep<false>;
+}
+
+Detectors::Detectors() {
     // === Tss Detection
-    m_sensitivity = 5.0;
-    m_hysterisisFactor = 0.4;
-    m_minFrames = 20;
-    m_minFramesLong = 100;
     m_lowPassWeight = kDefaultLowPassWeight;
 
     // === Pop detection
-    m_startBin = 2;
-    m_maxShiftDown = 4;
-    m_maxShiftUp = 2;
-    m_popSensitivity = 8.5;
+    popTemplateTable();
     m_framesSincePop = 0;
 
-    // debugLog = new std::ofstream("/Users/tristan/misc/popclick.log");
-
-    // === FFT
-    m_inReal = new float[kBlockSize];
-    m_splitData.realp = new float[kSpectrumSize];
-    m_splitData.imagp = new float[kSpectrumSize];
-    m_window = new float[kWindowSize];
-    memset(m_window, 0, sizeof(float) * kWindowSize);
-    vDSP_hann_window(m_window, kWindowSize, vDSP_HANN_NORM);
+    // tuning comes from the configuration passed to initialise
 
-    m_fftSetup = vDSP_create_fftsetup(kLogBlockSize, FFT_RADIX2);
+    // debugLog = new std::ofstream("/Users/tristan/misc/popclick.log");
 }
 
 Detectors::~Detectors() {
-    delete[] m_overlapBuffer;
-
-    delete[] m_inReal;
-    delete[] m_splitData.realp;
-    delete[] m_splitData.imagp;
-    delete[] m_window;
     // delete debugLog;
+}
 
-    vDSP_destroy_fftsetup(m_fftSetup);
+void *Detectors::operator new(size_t size) {
+    void *p = NULL;
+    if(posix_memalign(&p, DETECTORS_ALIGNMENT, size) != 0) throw std::bad_alloc();
+    return p;
 }
 
-bool Detectors::initialise() {
-    // Real initialisation work goes here!
-    m_savedOtherBands = 0.0002;
-    m_consecutiveMatches = 0;
-    m_framesSinceSpeech = 1000;
-    m_framesSinceMatch = 1000;
-    m_lowPassBuffer.resize(kSpectrumSize, 0.0);
+void Detectors::operator delete(void *p) {
+    free(p);
+}
+
+bool Detectors::initialise(int sampleRate) {
+    detectors_config_t config;
+    detectors_default_config(&config);
+    return initialise(sampleRate, config);
+}
 
-    m_spectrum.resize(kSpectrumSize, 0.0);
-    m_popBuffer.clear();
-    for(unsigned i = 0; i < kBufferSize; ++i) {
-        m_popBuffer.push_back(0.0);
+bool Detectors::initialise(int sampleRate, const detectors_config_t &config, const TemplatePack *templates) {
+    // Real initialisation work goes here!
+    if(!m_resampler.init(sampleRate, DETECTORS_SAMPLE_RATE)) return false;
+    size_t usableBins = static_cast<size_t>(m_resampler.passband() * kBlockSize);
+    m_mainBandHi = std::min(kMainBandHi, usableBins);
+    m_upperBandHi = std::min(kUpperBandHi, usableBins);
+    memset(m_samples, 0, sizeof(m_samples));
+    m_sampleCursor = 0;
+    m_hopFill = 0;
+    m_samplesPushed = 0;
+
+    tssReset(m_tss);
+    std::fill(m_lowPassBuffer, m_lowPassBuffer+kSpectrumSize, 0.0f);
+
+    std::fill(m_spectrum, m_spectrum+kSpectrumSize, 0.0f);
+    memset(m_popHistory, 0, sizeof(m_popHistory));
+    memset(m_popColumnSums, 0, sizeof(m_popColumnSums));
+    m_popCursor = 0;
+    m_builtinPop.table = &popTemplateTable();
+    m_builtinPop.code = POP_CODE;
+    m_popTemplates = templates ? templates->templates() : &m_builtinPop;
+    m_numPopTemplates = templates ? templates->size() : 1;
+    m_templatePack = templates;
+    std::fill(m_popCandidate, m_popCandidate+POP_TEMPLATE_PACK_MAX_TEMPLATES, false);
+    m_popCandidates.store(0);
+    m_popScored.store(0);
+    m_popMax.reset();
+
+    // the filterbank covers the same bins as avgBand would, the upper band may go unused like there
+    m_engine = config.engine;
+    if(m_engine == DETECTORS_ENGINE_FILTERBANK && m_mainBandHi > kMainBandLow) {
+        size_t low[BandFilterbank::kBands] = {kLowerBandLow, kMainBandLow, kUpperBandLo};
+        size_t high[BandFilterbank::kBands] = {kLowerBandHi, m_mainBandHi,
+            m_upperBandHi >= kUpperBandLo + kMinUpperBandWidth ? m_upperBandHi : kUpperBandHi};
+        m_filterbank.init(low, high, kBlockSize, DETECTORS_SAMPLE_RATE,
+                          m_resampler.cutoff() * DETECTORS_SAMPLE_RATE);
     }
+    std::fill(m_bandLowPass, m_bandLowPass+BandFilterbank::kBands, 0.0f);
+    m_gateBackground = 0.0f;
+    m_fftHopsLeft = 0;
+
+    m_configSlots[0] = config;
+    m_configFront = 0;
+    m_configMiddle.store(1);
+    m_configBack = 2;
+    applyConfig(config);
 
     return true;
 }
 
+void Detectors::setConfig(const detectors_config_t &config) {
+    m_configSlots[m_configBack] = config;
+    m_configBack = m_configMiddle.exchange(m_configBack | kConfigFresh, memory_order_acq_rel) & ~kConfigFresh;
+}
+
+void Detectors::applyConfig(const detectors_config_t &config) {
+    m_tssParams.sensitivity = config.tssSensitivity;
+    m_tssParams.hysterisisFactor = config.tssHysteresisFactor;
+    m_tssParams.minFrames = config.tssMinFrames;
+    m_tssParams.minFramesLong = config.tssMinFramesLong;
+    m_tssParams.delayMatch = config.tssDelayMatch != 0;
+    m_tssStep = tssStepFor(m_tssParams);
+
+    m_builtinPop.sensitivity = config.popSensitivity;
+    popShiftRange(config.popMaxShiftUp, config.popMaxShiftDown, m_builtinPop);
+    m_popDebounceFrames = std::max(config.popDebounceFrames, 0);
+}
+
 int Detectors::process(const float *buffer) {
-    // return processChunk(buffer);
-    // copy last frame to start of the buffer
-    std::copy(m_overlapBuffer+kBlockSize, m_overlapBuffer+(kBlockSize*2), m_overlapBuffer);
-    // copy new input to the second half of the overlap buffer
-    std::copy(buffer,buffer+kBlockSize,m_overlapBuffer+kBlockSize);
+    return push(buffer, kBlockSize, NULL, NULL);
+}
+
+int Detectors::push(const float *samples, size_t count, detectors_event_fn sink, void *userdata) {
+    if(m_configMiddle.load(memory_order_relaxed) & kConfigFresh) {
+        m_configFront = m_configMiddle.exchange(m_configFront, memory_order_acq_rel) & ~kConfigFresh;
+        applyConfig(m_configSlots[m_configFront]);
+    }
+
+    if(m_resampler.passthrough()) return pushNative(samples, count, sink, userdata);
 
     int result = 0;
-    for(int i = 0; i < kNumSteps; ++i) {
-        float *ptr = m_overlapBuffer+((i+1)*kStepSize);
-        result |= processChunk(ptr);
+    size_t done = 0;
+    while(done < count) {
+        size_t used;
+        size_t produced = m_resampler.process(samples+done, count-done, m_resampled, kBlockSize, used);
+        done += used;
+        result |= pushNative(m_resampled, produced, sink, userdata);
+    }
+    return result;
+}
+
+// Same as push but for samples already at DETECTORS_SAMPLE_RATE
+int Detectors::pushNative(const float *samples, size_t count, detectors_event_fn sink, void *userdata) {
+    int result = 0;
+    size_t done = 0;
+    while(done < count) {
+        // copy up to the next hop or the end of the ring, whichever comes first
+        size_t room = std::min(kStepSize - m_hopFill, kBlockSize - m_sampleCursor);
+        size_t n = std::min(count - done, room);
+        std::copy(samples+done, samples+done+n, m_samples+m_sampleCursor);
+        std::copy(samples+done, samples+done+n, m_samples+m_sampleCursor+kBlockSize);
+        m_sampleCursor = (m_sampleCursor + n) % kBlockSize;
+        m_hopFill += n;
+        m_samplesPushed += n;
+        done += n;
+        if(m_hopFill < kStepSize) continue;
+
+        m_hopFill = 0;
+        int events = processChunk(m_samples+m_sampleCursor);
+        if(events && sink) sink(userdata, events, m_resampler.inputPosition(m_samplesPushed));
+        result |= events;
     }
     return result;
 }
 
 void Detectors::doFFT(const float *buffer) {
-    vDSP_vmul(buffer, 1, m_window, 1, m_inReal, 1, kBlockSize);
-    vDSP_ctoz(reinterpret_cast<DSPComplex*>(m_inReal), 2, &m_splitData, 1, kSpectrumSize);
-    vDSP_fft_zrip(m_fftSetup, &m_splitData, 1, kLogBlockSize, FFT_FORWARD);
-    m_splitData.imagp[0] = 0.0f;
-
-    float scale = 1.0f / static_cast<float>(2 * kBlockSize);
-    vDSP_vsmul(m_splitData.realp, 1, &scale, m_splitData.realp, 1, kSpectrumSize);
-    vDSP_vsmul(m_splitData.imagp, 1, &scale, m_splitData.imagp, 1, kSpectrumSize);
+    m_fft.forward(buffer, m_fftReal, m_fftImag);
+}
+
+// Fires when the newest hop is much louder than the recent background, the only time the filterbank engine
+// looks for pops
+bool Detectors::transientGate(const float *hop) {
+    vec4 sums = vec4_set1(0.0f), squares = vec4_set1(0.0f);
+    for(int i = 0; i < kStepSize; i += 4) {
+        vec4 x = vec4_load(hop + i);
+        sums = vec4_add(sums, x);
+        squares = vec4_add(squares, vec4_mul(x, x));
+    }
+    float sum = vec4_hsum(sums), sumSquares = vec4_hsum(squares);
+    // with the mean taken out so a DC offset in the input doesn't count
+    float power = (sumSquares - sum*sum/kStepSize) / kStepSize;
+    // let garbage through to the pop detector like the FFT engine does, but keep it out of the background
+    if(!(power < numeric_limits<float>::infinity())) return true;
+    bool fire = power > kGateFloor && power > kGateRatio*m_gateBackground;
+    m_gateBackground += (power - m_gateBackground) * kGateSmoothing;
+    return fire;
 }
 
 int Detectors::processChunk(const float *buffer) {
-    doFFT(buffer);
+    const float *hop = buffer + kBlockSize - kStepSize;
+    const bool filterbank = m_engine == DETECTORS_ENGINE_FILTERBANK;
+    HopTimer timer;
+    timer.mark(DETECTORS_TRACE_FFT);
+    bool freshSpectrum = true;
+    if(filterbank) {
+        if(transientGate(hop)) m_fftHopsLeft = kGateHops;
+        freshSpectrum = m_fftHopsLeft > 0;
+        if(freshSpectrum) m_fftHopsLeft -= 1;
+    }
+    if(freshSpectrum) doFFT(buffer);
+    timer.mark(DETECTORS_TRACE_SPECTRUM);
 
     int result = 0;
     size_t n = kSpectrumSize;
 
-    for (size_t i = 0; i < n; ++i) {
-        float real = m_splitData.realp[i];
-        float imag = m_splitData.imagp[i];
-        float newVal = real * real + imag * imag;
-        m_spectrum[i] = newVal;
-        m_lowPassBuffer[i] = m_lowPassBuffer[i]*(1.0f-m_lowPassWeight) + newVal*m_lowPassWeight;
-
-        // infinite values happen non-deterministically, probably due to glitchy audio input at start of recording
-        // but inifinities it could mess up things forever
-        if(m_lowPassBuffer[i] >= numeric_limits<float>::infinity()) {
-            std::fill(m_lowPassBuffer.begin(), m_lowPassBuffer.end(), 0.0f);
-            return 0; // discard the frame, it's probably garbage
+    // at low sample rates like 8kHz telephony none of the main band survives and only pops can be detected
+    const bool tssEnabled = m_mainBandHi > kMainBandLow;
+    if(!filterbank) {
+        for (size_t i = 0; i < n; ++i) {
+            float real = m_fftReal[i];
+            float imag = m_fftImag[i];
+            float newVal = real * real + imag * imag;
+            m_spectrum[i] = newVal;
+            m_lowPassBuffer[i] = m_lowPassBuffer[i]*(1.0f-m_lowPassWeight) + newVal*m_lowPassWeight;
+
+            // infinite values happen non-deterministically, probably due to glitchy audio input at start of recording
+            // but inifinities it could mess up things forever
+            if(m_lowPassBuffer[i] >= numeric_limits<float>::infinity()) {
+                std::fill(m_lowPassBuffer, m_lowPassBuffer+kSpectrumSize, 0.0f);
+                return discardHop(timer); // discard the frame, it's probably garbage
+            }
         }
-    }
-
-    float lowerBand = avgBand(m_lowPassBuffer, kLowerBandLow, kLowerBandHi);
-    float mainBand = avgBand(m_lowPassBuffer, kMainBandLow, kMainBandHi);
-    float upperBand = avgBand(m_lowPassBuffer, kUpperBandLo, kUpperBandHi);
-
-    m_framesSinceSpeech += 1;
-    if(lowerBand > kSpeechThresh) {
-        m_framesSinceSpeech = 0;
-    }
-
-    float debugMarker = 0.0002;
-    float matchiness = mainBand / ((lowerBand+upperBand)/2.0f);
-    bool outOfShadow = m_framesSinceSpeech > kSpeechShadowTime;
-    int immediateMatchFrame = kDelayMatch ? m_minFramesLong : m_minFrames;
-    m_framesSinceMatch += 1;
-    if(((matchiness >= m_sensitivity) ||
-        (m_consecutiveMatches > 0 && matchiness >= m_sensitivity*m_hysterisisFactor) ||
-        (m_consecutiveMatches > immediateMatchFrame && (mainBand/m_savedOtherBands) >= m_sensitivity*m_hysterisisFactor*0.5f))
-     && outOfShadow) {
-        debugMarker = 0.01;
-        // second one in double "tss" came earlier than trigger timer
-        if(kDelayMatch && m_consecutiveMatches == 0 && m_framesSinceMatch <= m_minFramesLong) {
-            result |= TSS_START_CODE;
-            result |= TSS_STOP_CODE;
-            m_framesSinceMatch = 1000;
+    } else {
+        // the same garbage as above, it would also leave an infinite column in the pop history that keeps every
+        // window it's in from being scored, so the hop is thrown away before the column is pushed like above
+        bool garbage = false;
+        if(freshSpectrum) {
+            for(size_t i = 0; i < n; ++i) {
+                m_spectrum[i] = m_fftReal[i]*m_fftReal[i] + m_fftImag[i]*m_fftImag[i];
+                garbage = garbage || m_spectrum[i] >= numeric_limits<float>::infinity();
+            }
         }
-
-        m_consecutiveMatches += 1;
-        if(kDelayMatch && m_consecutiveMatches == m_minFrames) {
-            m_framesSinceMatch = m_consecutiveMatches;
-        } else if(m_consecutiveMatches == immediateMatchFrame) {
-            debugMarker = 1.0;
-            result |= TSS_START_CODE;
-            m_savedOtherBands = ((lowerBand+upperBand)/2.0f);
+        if(tssEnabled && !garbage) {
+            float bands[BandFilterbank::kBands];
+            m_filterbank.processHop(hop, kStepSize, bands);
+            for(int b = 0; b < BandFilterbank::kBands; ++b) {
+                m_bandLowPass[b] = m_bandLowPass[b]*(1.0f-m_lowPassWeight) + bands[b]*m_lowPassWeight;
+                garbage = garbage || !(m_bandLowPass[b] < numeric_limits<float>::infinity());
+            }
         }
-    } else {
-        bool delayedMatch = kDelayMatch && (m_framesSinceMatch == m_minFramesLong && outOfShadow);
-        if(delayedMatch) {
-            result |= TSS_START_CODE;
+        // unlike the low pass above the filters themselves would also stay broken
+        if(garbage) {
+            m_filterbank.reset();
+            std::fill(m_bandLowPass, m_bandLowPass+BandFilterbank::kBands, 0.0f);
+            return discardHop(timer);
         }
-        if(m_consecutiveMatches >= immediateMatchFrame || delayedMatch) {
-            debugMarker = 2.0;
-            result |= TSS_STOP_CODE;
+    }
+
+    timer.mark(DETECTORS_TRACE_BANDS);
+
+    float lowerBand = 0.0f, mainBand = 0.0f, upperBand = 0.0f;
+    if(tssEnabled) {
+        bool hasUpperBand = m_upperBandHi >= kUpperBandLo + kMinUpperBandWidth;
+        if(filterbank) {
+            lowerBand = m_bandLowPass[0];
+            mainBand = m_bandLowPass[1];
+            upperBand = hasUpperBand ? m_bandLowPass[2] : lowerBand;
+        } else {
+            lowerBand = avgBand(m_lowPassBuffer, kLowerBandLow, kLowerBandHi);
+            mainBand = avgBand(m_lowPassBuffer, kMainBandLow, m_mainBandHi);
+            upperBand = hasUpperBand ? avgBand(m_lowPassBuffer, kUpperBandLo, m_upperBandHi) : lowerBand;
         }
-        m_consecutiveMatches = 0;
+
+        result |= m_tssStep(m_tss, m_tssParams, lowerBand, mainBand, upperBand);
     }
+    timer.mark(DETECTORS_TRACE_POP);
 
     // ===================== Pop Detection =================================
     // update buffer forward one time step
-    for(unsigned i = 0; i < kBufferPrimaryHeight; ++i) {
-        m_popBuffer.pop_front();
-        m_popBuffer.push_back(m_spectrum[i]);
-    }
-    // high frequencies aren't useful so we bin them all together
-    m_popBuffer.pop_front();
-    float highSum = accumulate(m_spectrum.begin()+kBufferPrimaryHeight,m_spectrum.end(),0.0);
-    m_popBuffer.push_back(highSum);
-
-    std::deque<float>::iterator maxIt = max_element(m_popBuffer.begin(), m_popBuffer.end());
-    float minDiff = 10000000.0;
-    for(int i = -m_maxShiftUp; i < m_maxShiftDown; ++i) {
-        float diff = templateDiff(*maxIt, i);
-        if(diff < minDiff) minDiff = diff;
-    }
+    // without a fresh spectrum the gate saw nothing pop-like, an empty column stands in for the quiet
+    float column[kPopStride] = {0};
+    if(freshSpectrum) popColumn(column);
+    pushPopColumn(column);
 
+    // a pop can't be reported until the debounce passes, and an all zero (or garbage) history can't match
     m_framesSincePop += 1;
-    if(minDiff < m_popSensitivity && m_framesSincePop > 15) {
-        result |= POP_CODE; // Detected pop
-        m_framesSincePop = 0;
+    float maxVal = m_popMax.max();
+    float minDiff = -1.0f;
+    if(m_framesSincePop > m_popDebounceFrames && maxVal > 0.0f && maxVal < numeric_limits<float>::infinity()) {
+        // only this thread writes the counters, so there's no need for a locked increment
+        m_popCandidates.store(m_popCandidates.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        int code = matchPopTemplates(1.0f / maxVal, minDiff);
+        if(code) {
+            result |= code; // Detected pop
+            m_framesSincePop = 0;
+        }
     }
+    timer.mark(DETECTORS_TRACE_STAGES);
+
+#ifdef DETECTORS_TRACE
+    detectors_trace_record_t record;
+    record.lowerBand = lowerBand;
+    record.mainBand = mainBand;
+    record.upperBand = upperBand;
+    record.matchiness = m_tss.matchiness;
+    record.debugMarker = m_tss.debugMarker;
+    record.minDiff = minDiff;
+    record.events = result;
+    traceHop(timer, record);
+#endif
 
-    // *debugLog << lowerBand << ' ' << mainBand << ' ' << optionalBand << ' ' << upperBand << '-' << matchiness << ' ' << debugMarker << std::endl;
     return result;
 }
 
-float Detectors::avgBand(std::vector<float> &frame, size_t low, size_t hi) {
+// Throws away a hop of garbage input, after it's had its trace record so the trace still has one for every hop
+int Detectors::discardHop(HopTimer &timer) {
+    timer.mark(DETECTORS_TRACE_BANDS);
+    timer.mark(DETECTORS_TRACE_POP);
+    timer.mark(DETECTORS_TRACE_STAGES);
+#ifdef DETECTORS_TRACE
+    detectors_trace_record_t record = {};
+    record.minDiff = -1.0f;
+    traceHop(timer, record);
+#endif
+    return 0;
+}
+
+#ifdef DETECTORS_TRACE
+void Detectors::traceHop(const HopTimer &timer, detectors_trace_record_t &record) {
+    record.sample = m_samplesPushed;
+    for(int stage = 0; stage < DETECTORS_TRACE_STAGES; ++stage) {
+        record.ticks[stage] = static_cast<unsigned int>(timer.stamps[stage+1] - timer.stamps[stage]);
+    }
+    record.reserved = 0;
+    m_trace.push(record);
+}
+#endif
+
+float Detectors::avgBand(const float *frame, size_t low, size_t hi) {
     float sum = 0;
     for (size_t i = low; i < hi; ++i) {
         sum += frame[i];
@@ -221,47 +439,243 @@ float Detectors::avgBand(std::vector<float> &frame, size_t low, size_t hi) {
     return sum / (hi - low);
 }
 
-float Detectors::templateAt(int i, int shift) {
-    int bin = i % kBufferHeight;
-    if(i % kBufferHeight >= kBufferPrimaryHeight) {
-        return kPopTemplate[i]/kPopTemplateMax;
+// Matches the history against every template, returning the code of the closest match relative to its
+// sensitivity or 0 if none match. minDiff gets the smallest distance seen, or a bound on it for the trace.
+// The history is only scaled once however many templates there are, the window's total picks out the few
+// pack templates it could be close to with a binary search, and their column totals rule out most of the rest
+// before any are matched cell by cell.
+int Detectors::matchPopTemplates(float invMax, float &minDiff) {
+    const vec4 scale = vec4_set1(invMax);
+    alignas(16) float sums[kBufferWidth];
+    vec4 totals = vec4_set1(0.0f);
+    for(int v = 0; v < kBufferWidth/4; ++v) {
+        vec4 s = vec4_mul(vec4_load(m_popColumnSums + m_popCursor + 4*v), scale);
+        vec4_store(sums + 4*v, s);
+        totals = vec4_add(totals, s);
     }
-    if(bin+shift < 0 || bin+shift >= kBufferPrimaryHeight) {
-        return 0.0;
+
+    int candidates[POP_TEMPLATE_PACK_MAX_TEMPLATES];
+    int numCandidates = 0;
+    minDiff = numeric_limits<float>::infinity();
+    if(!m_templatePack) {
+        for(int t = 0; t < m_numPopTemplates; ++t) candidates[numCandidates++] = t;
+    } else {
+        const float total = vec4_hsum(totals);
+        const float radius = m_templatePack->totalRadius();
+        const PopTemplateTotal *begin = m_templatePack->totals(), *end = begin + m_templatePack->numTotals();
+        const PopTemplateTotal lo = {total - radius, 0}, hi = {total + radius, 0};
+        // shifts outside the range are at least radius away, the ones inside at least their own difference
+        minDiff = radius;
+        for(const PopTemplateTotal *it = std::lower_bound(begin, end, lo); it != end && !(hi < *it); ++it) {
+            float diff = fabsf(it->total - total);
+            if(diff >= m_popTemplates[it->templ].sensitivity * kPopBoundSlack) {
+                minDiff = std::min(minDiff, diff);
+            } else if(!m_popCandidate[it->templ]) {
+                m_popCandidate[it->templ] = true;
+                candidates[numCandidates++] = it->templ;
+            }
+        }
+        for(int i = 0; i < numCandidates; ++i) m_popCandidate[candidates[i]] = false;
     }
-    return kPopTemplate[i+shift]/kPopTemplateMax;
+
+    int code = 0;
+    float bestRatio = numeric_limits<float>::infinity();
+    bool scaled = false;
+    for(int i = 0; i < numCandidates; ++i) {
+        const PopTemplate &templ = m_popTemplates[candidates[i]];
+        // without a transient the history's column totals are already too far off the template's to match
+        float diff = templateLowerBound(templ, sums);
+        if(diff < templ.sensitivity * kPopBoundSlack) {
+            if(!scaled) {
+                // only this thread writes the counters, so there's no need for a locked increment
+                m_popScored.store(m_popScored.load(memory_order_relaxed) + 1, memory_order_release);
+                const float *window = m_popHistory[m_popCursor];
+                for(int col = 0; col < kBufferWidth; ++col) {
+                    for(int v = 0; v < kPopStride/4; ++v) {
+                        vec4_store(m_popWindow[col] + 4*v, vec4_mul(vec4_load(window + col*kPopStride + 4*v), scale));
+                    }
+                }
+                scaled = true;
+            }
+            diff = templateDiff(templ, templ.sensitivity);
+            if(diff < templ.sensitivity && diff / templ.sensitivity < bestRatio) {
+                bestRatio = diff / templ.sensitivity;
+                code = templ.code;
+            }
+        }
+        minDiff = std::min(minDiff, diff);
+    }
+    return code;
 }
 
-float Detectors::diffCol(int templStart, int bufStart, float maxVal, int shift) {
-    float diff = 0;
-    for(unsigned i = m_startBin; i < kBufferHeight; ++i) {
-        float d = templateAt(templStart+i, shift) - m_popBuffer[bufStart+i]/maxVal;
-        diff += abs(d);
+// Scores the scaled window against every shift of the template in one pass, returning the smallest L1
+// distance. Once every shift's partial sum reaches bound the result can only be used to reject a match so it
+// stops early and returns a value >= bound.
+float Detectors::templateDiff(const PopTemplate &templ, float bound) {
+    vec4 acc[kNumPopShifts];
+    for(int s = 0; s < templ.numShifts; ++s) acc[s] = vec4_set1(0.0f);
+
+    float minDiff = 0.0f;
+    for(int col = 0; col < kBufferWidth; ++col) {
+        vec4 h[kPopStride/4];
+        for(int v = 0; v < kPopStride/4; ++v) h[v] = vec4_load(m_popWindow[col] + 4*v);
+        for(int s = 0; s < templ.numShifts; ++s) {
+            const float *cells = templ.table->cells[templ.firstShift+s][col];
+            for(int v = 0; v < kPopStride/4; ++v) {
+                acc[s] = vec4_add(acc[s], vec4_abs(vec4_sub(vec4_load(cells + 4*v), h[v])));
+            }
+        }
+        // check for an early exit every few columns, the horizontal sums aren't free
+        if((col & 7) == 7 || col == kBufferWidth-1) {
+            minDiff = numeric_limits<float>::infinity();
+            for(int s = 0; s < templ.numShifts; ++s) {
+                minDiff = std::min(minDiff, vec4_hsum(acc[s]));
+            }
+            if(minDiff >= bound) break;
+        }
     }
-    return diff;
+    return minDiff;
 }
 
-float Detectors::templateDiff(float maxVal, int shift) {
-    float diff = 0;
-    for(unsigned i = 0; i < kBufferSize; i += kBufferHeight) {
-        diff += diffCol(i,i, maxVal,shift);
+// A lower bound on templateDiff from the scaled column sums alone: the L1 distance between two columns is at
+// least the difference of their totals. Costs about as much as scoring a single column.
+float Detectors::templateLowerBound(const PopTemplate &templ, const float *sums) {
+    vec4 h[kBufferWidth/4];
+    for(int v = 0; v < kBufferWidth/4; ++v) h[v] = vec4_load(sums + 4*v);
+    float bound = numeric_limits<float>::infinity();
+    for(int s = 0; s < templ.numShifts; ++s) {
+        const float *columnSums = templ.table->columnSums[templ.firstShift+s];
+        vec4 acc = vec4_set1(0.0f);
+        for(int v = 0; v < kBufferWidth/4; ++v) {
+            acc = vec4_add(acc, vec4_abs(vec4_sub(vec4_load(columnSums + 4*v), h[v])));
+        }
+        bound = std::min(bound, vec4_hsum(acc));
     }
-    return diff;
+    return bound;
+}
+
+detectors_pop_stats_t Detectors::popStats() const {
+    detectors_pop_stats_t stats;
+    // candidates is counted before scored, so reading scored first means it can't come out ahead
+    stats.scored = m_popScored.load(memory_order_acquire);
+    stats.candidates = m_popCandidates.load(memory_order_relaxed);
+    return stats;
+}
+
+// The newest column of the pop history from the current spectrum
+void Detectors::popColumn(float *column) const {
+    std::copy(m_spectrum, m_spectrum+kBufferPrimaryHeight, column);
+    // high frequencies aren't useful so we bin them all together
+    column[kBufferPrimaryHeight] = accumulate(m_spectrum+kBufferPrimaryHeight,m_spectrum+kSpectrumSize,0.0);
+}
+
+void Detectors::pushPopColumn(const float *column) {
+    m_popMax.push(*max_element(column, column+kBufferHeight));
+
+    // the low bins count towards the max but aren't matched, so zero them like the template table
+    float *dst = m_popHistory[m_popCursor];
+    std::fill(dst, dst+kPopStartBin, 0.0f);
+    std::copy(column+kPopStartBin, column+kPopStride, dst+kPopStartBin);
+    std::copy(dst, dst+kPopStride, m_popHistory[m_popCursor+kBufferWidth]);
+    m_popColumnSums[m_popCursor] = m_popColumnSums[m_popCursor+kBufferWidth] = accumulate(dst, dst+kPopStride, 0.0f);
+    m_popCursor = (m_popCursor + 1) % kBufferWidth;
 }
 
 extern "C" {
-    detectors_t *detectors_new() {
-        Detectors *dets = new Detectors();
-        dets->initialise();
+    void detectors_default_config(detectors_config_t *config) {
+        TssParams tss = tssDefaultParams();
+        config->tssSensitivity = tss.sensitivity;
+        config->tssHysteresisFactor = tss.hysterisisFactor;
+        config->tssMinFrames = tss.minFrames;
+        config->tssMinFramesLong = tss.minFramesLong;
+        config->tssDelayMatch = tss.delayMatch;
+        config->popSensitivity = kDefaultPopSensitivity;
+        config->popMaxShiftUp = kDefaultPopShiftUp;
+        config->popMaxShiftDown = kDefaultPopShiftDown;
+        config->popDebounceFrames = kDefaultPopDebounceFrames;
+        config->engine = DETECTORS_ENGINE_FFT;
+    }
+    detectors_t *detectors_new(int sampleRate) {
+        detectors_config_t config;
+        detectors_default_config(&config);
+        return detectors_new_with_config(sampleRate, &config);
+    }
+    detectors_t *detectors_new_with_config(int sampleRate, const detectors_config_t *config) {
+        return detectors_new_with_templates(sampleRate, config, NULL);
+    }
+    detectors_t *detectors_new_with_templates(int sampleRate, const detectors_config_t *config, const pop_templates_t *templates) {
+        detectors_config_t defaults;
+        if(!config) {
+            detectors_default_config(&defaults);
+            config = &defaults;
+        }
+        // exceptions can't cross into C callers, running out of memory is just a failure here like in the pool
+        Detectors *dets = NULL;
+        try {
+            dets = new Detectors();
+            if(!dets->initialise(sampleRate, *config, reinterpret_cast<const TemplatePack*>(templates))) {
+                delete dets;
+                return NULL;
+            }
+        } catch(...) {
+            delete dets;
+            return NULL;
+        }
         return reinterpret_cast<detectors_t*>(dets);
     }
+    void detectors_set_config(detectors_t *detectors, const detectors_config_t *config) {
+        Detectors *dets = reinterpret_cast<Detectors*>(detectors);
+        dets->setConfig(*config);
+    }
+    size_t detectors_trace_drain(detectors_t *detectors, detectors_trace_record_t *records, size_t maxRecords) {
+#ifdef DETECTORS_TRACE
+        return reinterpret_cast<Detectors*>(detectors)->trace().drain(records, maxRecords);
+#else
+        (void)detectors; (void)records; (void)maxRecords;
+        return 0;
+#endif
+    }
+    unsigned long long detectors_trace_dropped(detectors_t *detectors) {
+#ifdef DETECTORS_TRACE
+        return reinterpret_cast<Detectors*>(detectors)->trace().dropped();
+#else
+        (void)detectors;
+        return 0;
+#endif
+    }
+    void detectors_pop_stats(detectors_t *detectors, detectors_pop_stats_t *stats) {
+        *stats = reinterpret_cast<Detectors*>(detectors)->popStats();
+    }
     void detectors_free(detectors_t *detectors) {
         Detectors *dets = reinterpret_cast<Detectors*>(detectors);
         delete dets;
     }
+    size_t detectors_size(void) {
+        return sizeof(Detectors);
+    }
+    detectors_t *detectors_init_in(void *mem, int sampleRate, const detectors_config_t *config, const pop_templates_t *templates) {
+        detectors_config_t defaults;
+        if(!config) {
+            detectors_default_config(&defaults);
+            config = &defaults;
+        }
+        Detectors *dets = ::new(mem) Detectors();
+        if(!dets->initialise(sampleRate, *config, reinterpret_cast<const TemplatePack*>(templates))) {
+            dets->~Detectors();
+            return NULL;
+        }
+        return reinterpret_cast<detectors_t*>(dets);
+    }
+    void detectors_deinit(detectors_t *detectors) {
+        reinterpret_cast<Detectors*>(detectors)->~Detectors();
+    }
     int detectors_process(detectors_t *detectors, const float *buffer) {
         Detectors *dets = reinterpret_cast<Detectors*>(detectors);
         return dets->process(buffer);
     }
+    int detectors_push(detectors_t *detectors, const float *samples, size_t count, detectors_event_fn sink, void *userdata) {
+        Detectors *dets = reinterpret_cast<Detectors*>(detectors);
+        return dets->push(samples, count, sink, userdata);
+    }
 }
 
@@ -5,20 +5,103 @@
 // into any other project that wants to use them. It's open source so might as well make sharing easy.
 // The header exposes a C API along with C++ so that it can be used from .m and .c files and not just .mm and .cpp files
 
+#include <stddef.h>
+
+#include "templatePack.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define DETECTORS_BLOCK_SIZE 512
+// the rate the detectors were tuned at, other rates are resampled to it internally
+#define DETECTORS_SAMPLE_RATE 44100
 #define TSS_START_CODE 1
 #define TSS_STOP_CODE 2
 #define POP_CODE 4
 
+// Tuning knobs, frame counts are in hops of DETECTORS_BLOCK_SIZE/4 samples at DETECTORS_SAMPLE_RATE (about 3ms)
+typedef struct {
+    // "sss": how much louder the main band has to be than the bands around it, and the fraction of that
+    // needed to keep matching once started
+    float tssSensitivity;
+    float tssHysteresisFactor;
+    int tssMinFrames; // hops of matching before a start is reported
+    int tssMinFramesLong;
+    // nonzero to hold back the start until tssMinFramesLong, reporting a start and stop together for two
+    // short "sss"s in a row instead
+    int tssDelayMatch;
+    // pops: the largest template distance that still counts as a match. This and the shifts only apply to the
+    // built in template, the templates of a pack carry their own.
+    float popSensitivity;
+    // how many bins the template can be moved up or down to match, clamped to DETECTORS_MAX_POP_SHIFT_UP/DOWN
+    int popMaxShiftUp;
+    int popMaxShiftDown;
+    int popDebounceFrames; // hops after a pop before another can be reported
+    // How the "sss" band energies are computed, one of the DETECTORS_ENGINE_ values. Only read when the
+    // detectors are created, detectors_set_config can't switch engines.
+    int engine;
+} detectors_config_t;
+
+#define DETECTORS_MAX_POP_SHIFT_UP 4
+#define DETECTORS_MAX_POP_SHIFT_DOWN 6
+
+// An FFT of every hop, what the detectors were tuned on
+#define DETECTORS_ENGINE_FFT 0
+// A bank of band pass filters keeps the "sss" bands up to date and the FFT only runs for the pop detector while
+// a transient in the input might be a pop, which is much cheaper when the input is mostly quiet. Pops and "sss"
+// starts land on the same hop as the FFT engine's or the next one, but "sss" stops only agree to within a few
+// blocks and sometimes a second or more, since they're decided by the main band sinking into the noise floor.
+#define DETECTORS_ENGINE_FILTERBANK 1
+
+#ifndef DETECTORS_T_DEFINED
+#define DETECTORS_T_DEFINED
 typedef void detectors_t; // just an opaque wrapper for the C++ type
-detectors_t *detectors_new();
+#endif
+// Fills in the configuration the detectors were tuned with
+void detectors_default_config(detectors_config_t *config);
+// Returns NULL if the sample rate isn't supported, anything with a reasonable ratio to DETECTORS_SAMPLE_RATE
+// like 8000, 16000, 22050 or 48000 is fine, or if there's no memory for them. config may be NULL for the defaults.
+detectors_t *detectors_new(int sampleRate);
+detectors_t *detectors_new_with_config(int sampleRate, const detectors_config_t *config);
+// Matches the templates of a pack instead of the built in pop template, reporting each one's own event code.
+// The pack must outlive the detectors.
+detectors_t *detectors_new_with_templates(int sampleRate, const detectors_config_t *config, const pop_templates_t *templates);
 void detectors_free(detectors_t *detectors);
+
+// Placement in caller provided memory, so many streams can be carved out of one arena (huge pages, say) and
+// created or destroyed without touching the heap. mem must be detectors_size() bytes aligned to
+// DETECTORS_ALIGNMENT. Initialising never allocates, except that the first detectors at a sample rate other than
+// DETECTORS_SAMPLE_RATE design the resampling filter every later one at that rate shares. config and templates may
+// be NULL for the defaults. Returns NULL, with nothing to deinit, if the sample rate isn't supported.
+#define DETECTORS_ALIGNMENT 64
+size_t detectors_size(void);
+detectors_t *detectors_init_in(void *mem, int sampleRate, const detectors_config_t *config, const pop_templates_t *templates);
+// Ends detectors made with detectors_init_in, after which their memory can be reused
+void detectors_deinit(detectors_t *detectors);
+// Can be called from any one thread while another is processing, the new configuration is picked up without
+// locking at the start of the next detectors_process or detectors_push call
+void detectors_set_config(detectors_t *detectors, const detectors_config_t *config);
+// Processes exactly DETECTORS_BLOCK_SIZE samples at the rate given to detectors_new, returning the events detected in them
 int detectors_process(detectors_t *detectors, const float *buffer);
 
+// How often the pop detector had to do its full template matching, readable from any thread while processing.
+// Most hops can be ruled out from the history's column totals alone, which is far cheaper.
+typedef struct {
+    unsigned long long candidates; // hops past the debounce with anything in the pop history
+    unsigned long long scored; // candidates that couldn't be ruled out and went through full template matching
+} detectors_pop_stats_t;
+void detectors_pop_stats(detectors_t *detectors, detectors_pop_stats_t *stats);
+
+// Called by detectors_push for every hop with events. sample is the number of samples pushed since the detectors
+// were created up to and including the last sample of the hop, so the events happened at sample/sampleRate.
+// When resampling the hop ends between input samples, sample is then the last input sample it depended on.
+typedef void (*detectors_event_fn)(void *userdata, int events, unsigned long long sample);
+// Processes any number of samples, running the detectors every DETECTORS_BLOCK_SIZE/4 samples as they become
+// available and keeping the remainder for the next call. The sink may be NULL, either way the events of every
+// hop in this call are also returned together. Mixing this with detectors_process on one instance is fine.
+int detectors_push(detectors_t *detectors, const float *samples, size_t count, detectors_event_fn sink, void *userdata);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,56 +109,209 @@ int detectors_process(detectors_t *detectors, const float *buffer);
 // Also expose C++ API if used from C++ (or included in the implementation file)
 #ifdef __cplusplus
 
-#include <vector>
-#include <deque>
-#include <Accelerate/Accelerate.h>
+#include <atomic>
+#include <cstddef>
+#include "detectorTrace.h"
+#include "fft.h"
+#include "filterbank.h"
+#include "resampler.h"
+
+// Tuning of the "sss" detector
+struct TssParams {
+    float sensitivity;
+    float hysterisisFactor;
+    int minFrames;
+    int minFramesLong;
+    bool delayMatch;
+};
+
+// Per stream state of the "sss" detector's hysteresis, advanced once per hop by tssStep
+struct TssState {
+    int consecutiveMatches;
+    unsigned long framesSinceSpeech;
+    unsigned long framesSinceMatch;
+    float savedOtherBands;
+#ifdef DETECTORS_TRACE
+    // what the last step saw, for the trace
+    float matchiness;
+    float debugMarker;
+#endif
+};
+
+// Everything needed to match one pop template: the template expanded for every shift, the range of those shifts
+// to try, and what to report when the distance to one of them is under sensitivity
+struct PopTemplateTable;
+struct PopTemplate {
+    const PopTemplateTable *table;
+    int code;
+    float sensitivity;
+    int firstShift;
+    int numShifts;
+};
+class TemplatePack;
+struct PopTemplateTotal;
+
+// One hop of the "sss" detector, specialised on TssParams::delayMatch so the usual path has no delay logic in it
+typedef int (*TssStepFn)(TssState &state, const TssParams &params, float lowerBand, float mainBand, float upperBand);
+
+// Max of the last Width values pushed, kept as a monotonic queue of maxima decreasing from the front
+// so each push is O(1) amortized instead of rescanning the whole window.
+template<int Width>
+class SlidingMax {
+public:
+    // starts out as if Width zeros had been pushed
+    void reset() {
+        m_count = Width;
+        m_head = 0;
+        m_size = 1;
+        m_values[0] = 0.0f;
+        m_indices[0] = m_count - 1;
+    }
+
+    void push(float value) {
+        unsigned long index = m_count++;
+        // drop maxima that can never be the max again since this value is both newer and at least as big
+        while(m_size > 0 && m_values[(m_head+m_size-1) % Width] <= value) {
+            m_size -= 1;
+        }
+        // and the front if it has scrolled out of the window
+        if(m_size > 0 && m_indices[m_head] + Width <= index) {
+            m_head = (m_head + 1) % Width;
+            m_size -= 1;
+        }
+        int back = (m_head + m_size) % Width;
+        m_values[back] = value;
+        m_indices[back] = index;
+        m_size += 1;
+    }
+
+    float max() const { return m_values[m_head]; }
+
+private:
+    float m_values[Width];
+    unsigned long m_indices[Width];
+    int m_head;
+    int m_size;
+    unsigned long m_count;
+};
+
+// All the state of one stream lives inside the object, with no allocations of its own, so any number of them can
+// be placed in memory the caller provides (see detectors_init_in). Members are grouped by when they're used:
+// the input ring, then everything a hop reads and writes in the order it does, then the state shared with
+// other threads on cache lines of its own so their writes don't keep invalidating the hop's lines.
 class Detectors {
 public:
     Detectors();
     ~Detectors();
 
-    bool initialise();
+    // new and delete keep instances DETECTORS_ALIGNMENT aligned, which plain new doesn't do before C++17
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+
+    // returns false if the sample rate isn't supported
+    bool initialise(int sampleRate = DETECTORS_SAMPLE_RATE);
+    // with templates the built in pop template is replaced by all the templates in the pack
+    bool initialise(int sampleRate, const detectors_config_t &config, const TemplatePack *templates = NULL);
+
+    // Thread safe against processing for one writer thread, takes effect at the next process or push
+    void setConfig(const detectors_config_t &config);
 
     int process(const float *buffer);
+    int push(const float *samples, size_t count, detectors_event_fn sink, void *userdata);
+    detectors_pop_stats_t popStats() const;
+
+    // Dimensions of the pop history, each column's 26 bins are padded so every column starts 16 byte aligned
+    static const int kPopHistoryWidth = 40;
+    static const int kPopHistoryStride = 28;
 
 protected:
+    int pushNative(const float *samples, size_t count, detectors_event_fn sink, void *userdata);
+    void applyConfig(const detectors_config_t &config);
     int processChunk(const float *buffer);
+    int discardHop(HopTimer &timer);
     void doFFT(const float *buffer);
+    bool transientGate(const float *hop);
+    float avgBand(const float *frame, size_t low, size_t hi);
+    int matchPopTemplates(float invMax, float &minDiff);
+    float templateDiff(const PopTemplate &templ, float bound);
+    float templateLowerBound(const PopTemplate &templ, const float *sums);
+    void popColumn(float *column) const;
+    void pushPopColumn(const float *column);
 
-    // Overlap
-    float *m_overlapBuffer;
+    // Input samples, a ring of the last DETECTORS_BLOCK_SIZE samples where every sample is written twice,
+    // DETECTORS_BLOCK_SIZE apart, so the window for the next hop is always contiguous starting at m_sampleCursor.
+    alignas(DETECTORS_ALIGNMENT) float m_samples[2*DETECTORS_BLOCK_SIZE];
 
+    // Everything small a hop touches, packed into a few cache lines
+    int m_sampleCursor;
+    int m_hopFill; // samples pushed since the last hop
+    unsigned long long m_samplesPushed;
+    int m_configFront; // configuration slot last applied, owned by the processing thread
+    int m_engine;
     // Tss detection
-    float m_sensitivity;
-    float m_hysterisisFactor;
+    TssStepFn m_tssStep;
+    TssParams m_tssParams;
+    TssState m_tss;
     float m_lowPassWeight;
-    int m_minFrames;
-    int m_minFramesLong;
-
-    std::vector<float> m_lowPassBuffer;
-    int m_consecutiveMatches;
-    unsigned long m_framesSinceSpeech;
-    unsigned long m_framesSinceMatch;
-    float m_savedOtherBands;
-
+    // the band edges that depend on how much of the spectrum survives resampling from a lower sample rate
+    size_t m_mainBandHi;
+    size_t m_upperBandHi;
+    // DETECTORS_ENGINE_FILTERBANK state. The FFT keeps running for m_fftHopsLeft hops after the transient gate
+    // fires, long enough for a pop to pass all the way through the pop history.
+    float m_bandLowPass[BandFilterbank::kBands];
+    float m_gateBackground; // slow moving average of the hop power the gate compares against
+    int m_fftHopsLeft;
     // Pop detection
-    std::vector<float> m_spectrum;
-    std::deque<float> m_popBuffer;
-    int m_maxShiftDown;
-    int m_maxShiftUp;
-    float m_popSensitivity;
+    int m_popCursor;
+    unsigned long m_popDebounceFrames;
     unsigned long m_framesSincePop;
-    int m_startBin;
-    float templateAt(int i, int shift);
-    float templateDiff(float maxVal, int shift);
-    float diffCol(int templStart, int bufStart, float maxVal, int shift);
+    // the templates matched, either just m_builtinPop or all the templates of a pack
+    const PopTemplate *m_popTemplates;
+    int m_numPopTemplates;
+    const TemplatePack *m_templatePack; // NULL for the built in template
+    PopTemplate m_builtinPop;
+    SlidingMax<kPopHistoryWidth> m_popMax;
+
+    // The spectrum of the latest hop in split form, its power, and the power low passed over hops
+    alignas(DETECTORS_ALIGNMENT) float m_fftReal[RealFFT::kSpectrumSize];
+    alignas(DETECTORS_ALIGNMENT) float m_fftImag[RealFFT::kSpectrumSize];
+    alignas(DETECTORS_ALIGNMENT) float m_spectrum[RealFFT::kSpectrumSize];
+    alignas(DETECTORS_ALIGNMENT) float m_lowPassBuffer[RealFFT::kSpectrumSize];
+
+    // The pop history is a circular buffer of spectrum columns. Every column is written twice, kPopHistoryWidth
+    // columns apart, so the latest kPopHistoryWidth columns are always contiguous starting at m_popCursor.
+    alignas(DETECTORS_ALIGNMENT) float m_popHistory[2*kPopHistoryWidth][kPopHistoryStride];
+    // the sum of every column in m_popHistory, mirrored the same way
+    alignas(DETECTORS_ALIGNMENT) float m_popColumnSums[2*kPopHistoryWidth];
+    // the latest window of the history scaled by 1/max, shared by every template it gets matched against
+    alignas(DETECTORS_ALIGNMENT) float m_popWindow[kPopHistoryWidth][kPopHistoryStride];
+    // marks the pack templates already picked to be matched this hop
+    bool m_popCandidate[POP_TEMPLATE_PACK_MAX_TEMPLATES];
 
-    float *m_inReal;
-    float *m_window;
-    FFTSetup m_fftSetup;
-    DSPSplitComplex m_splitData;
+    RealFFT m_fft;
+    BandFilterbank m_filterbank;
+    // Converts input at other sample rates to DETECTORS_SAMPLE_RATE, a block at a time through m_resampled
+    Resampler m_resampler;
+    alignas(DETECTORS_ALIGNMENT) float m_resampled[DETECTORS_BLOCK_SIZE];
 
-    float avgBand(std::vector<float> &frame, size_t low, size_t hi);
+    // Configuration updates are handed over through a lock-free triple buffer. The writer fills its own slot and
+    // swaps it into the middle, marking it fresh, the processing thread swaps a fresh middle slot with the one
+    // it last applied. Neither side ever waits and each only touches a slot it exclusively owns.
+    alignas(DETECTORS_ALIGNMENT) detectors_config_t m_configSlots[3];
+    std::atomic<int> m_configMiddle; // slot index, ORed with kConfigFresh when it hasn't been picked up yet
+    int m_configBack; // owned by the writer
+    static const int kConfigFresh = 4;
+
+    // written every hop and read by other threads through popStats
+    alignas(DETECTORS_ALIGNMENT) std::atomic<unsigned long long> m_popCandidates;
+    std::atomic<unsigned long long> m_popScored;
+
+#ifdef DETECTORS_TRACE
+    alignas(DETECTORS_ALIGNMENT) TraceRing m_trace;
+    void traceHop(const HopTimer &timer, detectors_trace_record_t &record);
+public:
+    TraceRing &trace() { return m_trace; }
+#endif
 };
 #endif
 
@@ -0,0 +1,112 @@
+#ifndef _DETECTORS_COMMON_H_
+#define _DETECTORS_COMMON_H_
+
+// Constants and building blocks shared by the detector implementations (Detectors and DetectorBank).
+// Not part of the public API, only include this from the implementation files.
+
+#include <vector>
+
+#include "detectors.h"
+#include "popTemplate.h"
+
+static const int kBlockSize = DETECTORS_BLOCK_SIZE;
+static const int kSpectrumSize = kBlockSize/2;
+
+static const int kNumSteps = 4;
+static const int kStepSize = kBlockSize / kNumSteps;
+
+static const size_t kMainBandLow = 40;
+static const size_t kMainBandHi = 100;
+static const size_t kOptionalBandHi = 180;
+
+static const size_t kLowerBandLow = 3;
+static const size_t kLowerBandHi = kMainBandLow;
+static const size_t kUpperBandLo = kOptionalBandHi;
+static const size_t kUpperBandHi = kSpectrumSize;
+// when resampling cuts off most of the upper band the main band is only compared against the lower band
+static const size_t kMinUpperBandWidth = 16;
+
+static const int kPopStartBin = 2;
+// the range of template shifts the precomputed template table covers, configurations are clamped to it
+static const int kPopShiftUp = DETECTORS_MAX_POP_SHIFT_UP;
+static const int kPopShiftDown = DETECTORS_MAX_POP_SHIFT_DOWN;
+static const int kNumPopShifts = kPopShiftUp + kPopShiftDown;
+static const int kPopStride = Detectors::kPopHistoryStride;
+// the pop tuning detectors_default_config gives
+static const int kDefaultPopShiftUp = 2;
+static const int kDefaultPopShiftDown = 4;
+static const float kDefaultPopSensitivity = 8.5;
+static const int kDefaultPopDebounceFrames = 15;
+// The template distance lower bound is summed in a different order than the distance itself, this much slack
+// keeps rounding from ever skipping a hop the full matching would have reported a pop for
+static const float kPopBoundSlack = 1.001f;
+static_assert(kBufferWidth % 4 == 0, "the column sums are compared 4 at a time");
+
+static const float kDefaultLowPassWeight = 0.6;
+// The filterbank engine's transient gate: a hop whose power is kGateRatio times the background and above
+// kGateFloor (about -80dBFS, so dither in digital silence doesn't count) keeps the FFT on for kGateHops hops
+static const float kGateRatio = 4.0;
+static const float kGateFloor = 1e-8;
+static const float kGateSmoothing = 0.02;
+static const int kGateHops = kBufferWidth;
+static const int kSpeechShadowTime = 100;
+static const float kSpeechThresh = 0.5;
+
+static_assert(kBlockSize == RealFFT::kSize, "the FFT is specialised for the block size");
+static_assert(alignof(Detectors) == DETECTORS_ALIGNMENT, "detectors_init_in promises this alignment");
+static_assert(kBufferWidth == Detectors::kPopHistoryWidth && kBufferHeight <= kPopStride && kPopStride % 4 == 0,
+              "pop history must fit the template");
+static_assert(kBufferWidth == POP_TEMPLATE_WIDTH && kBufferHeight == POP_TEMPLATE_HEIGHT,
+              "template packs are laid out like the built in template");
+
+// kPopTemplate divided by its max and expanded for every shift, laid out like the pop history so matching
+// is a straight walk over both. Bins below kPopStartBin and the column padding are zero, like in the history.
+struct PopTemplateTable {
+    alignas(16) float cells[kNumPopShifts][kBufferWidth][kPopStride];
+    // the sum of each column of cells, for bounding the distance before matching cell by cell
+    alignas(16) float columnSums[kNumPopShifts][kBufferWidth];
+    // templ is kBufferWidth columns of kBufferHeight bins like kPopTemplate, divided by templMax
+    PopTemplateTable(const float *templ, float templMax);
+};
+// the table for the built in kPopTemplate
+const PopTemplateTable &popTemplateTable();
+// Sets the range of table shifts to try for the requested shifts, clamped to what the tables cover.
+// Shifting down starts from the unshifted template so there's always at least one.
+void popShiftRange(int maxShiftUp, int maxShiftDown, PopTemplate &templ);
+
+// The total of every cell of one shift of a pack template. A window can only match that shift if its own
+// total is within the template's sensitivity of this, since the L1 distance is at least the difference.
+struct PopTemplateTotal {
+    float total;
+    int templ;
+    bool operator<(const PopTemplateTotal &other) const { return total < other.total; }
+};
+
+// The templates of a template pack with their tables, read only once loaded
+class TemplatePack {
+public:
+    bool load(const char *path);
+    const PopTemplate *templates() const { return &m_templates[0]; }
+    int size() const { return static_cast<int>(m_templates.size()); }
+
+    // The totals of every shift of every template in order, so the templates a window could match are found
+    // with a binary search instead of looking at each one
+    const PopTemplateTotal *totals() const { return &m_totals[0]; }
+    int numTotals() const { return static_cast<int>(m_totals.size()); }
+    // the largest template sensitivity with kPopBoundSlack, no shift further than this from a window's total matches
+    float totalRadius() const { return m_totalRadius; }
+
+private:
+    std::vector<PopTemplateTable> m_tables;
+    std::vector<PopTemplate> m_templates; // pointing into m_tables
+    std::vector<PopTemplateTotal> m_totals;
+    float m_totalRadius;
+};
+
+TssParams tssDefaultParams();
+void tssReset(TssState &state);
+// The tssStep specialisation for params.delayMatch. It takes the low passed band averages of one hop and returns
+// TSS_START_CODE/TSS_STOP_CODE bits.
+TssStepFn tssStepFor(const TssParams &params);
+
+#endif
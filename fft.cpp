@@ -0,0 +1,268 @@
+#include "fft.h"
+#include "simd.h"
+
+#include <cmath>
+
+static const int kSize = RealFFT::kSize;
+static const int kHalf = RealFFT::kSpectrumSize;
+
+namespace {
+// Everything that only depends on the block size is computed once in double precision and shared by
+// every instance, so constructing a detector does no trigonometry.
+struct FFTTables {
+    float window[kSize];
+    // twiddles for each radix-2 stage of the half size complex FFT stored contiguously, the stage with
+    // butterfly span h uses entries [h-1, 2h-1) so the inner loop walks them linearly
+    float stageRe[kHalf];
+    float stageIm[kHalf];
+    // e^(-2*pi*i*k/kSize) for splitting the half size transform into the real one
+    float splitRe[kHalf];
+    float splitIm[kHalf];
+    unsigned short bitReverse[kHalf];
+
+    FFTTables() {
+        const double pi = 3.14159265358979323846;
+        // same as vDSP_hann_window with vDSP_HANN_NORM
+        for(int i = 0; i < kSize; ++i) {
+            window[i] = static_cast<float>(0.5 * (1.0 - cos(2.0 * pi * i / kSize)));
+        }
+        stageRe[kHalf-1] = stageIm[kHalf-1] = 0.0f;
+        for(int h = 1; h < kHalf; h <<= 1) {
+            for(int j = 0; j < h; ++j) {
+                stageRe[h-1+j] = static_cast<float>(cos(pi * j / h));
+                stageIm[h-1+j] = static_cast<float>(-sin(pi * j / h));
+            }
+        }
+        for(int k = 0; k < kHalf; ++k) {
+            splitRe[k] = static_cast<float>(cos(2.0 * pi * k / kSize));
+            splitIm[k] = static_cast<float>(-sin(2.0 * pi * k / kSize));
+            unsigned rev = 0;
+            for(int b = 1; b < kHalf; b <<= 1) {
+                rev = (rev << 1) | ((k & b) ? 1 : 0);
+            }
+            bitReverse[k] = static_cast<unsigned short>(rev);
+        }
+    }
+};
+
+const FFTTables &fftTables() {
+    static const FFTTables tables;
+    return tables;
+}
+}
+
+#if defined(DETECTORS_FFT_VDSP)
+
+// vDSP setups are read only once created and can be used from any number of threads at once
+static FFTSetup sharedSetup() {
+    static const FFTSetup setup = vDSP_create_fftsetup(RealFFT::kLogSize, FFT_RADIX2);
+    return setup;
+}
+
+RealFFT::RealFFT() {
+    fftTables();
+    sharedSetup();
+}
+
+void RealFFT::forward(const float *input, float *realp, float *imagp) {
+    DSPSplitComplex split;
+    split.realp = realp;
+    split.imagp = imagp;
+    vDSP_vmul(input, 1, fftTables().window, 1, m_inReal, 1, kSize);
+    vDSP_ctoz(reinterpret_cast<DSPComplex*>(m_inReal), 2, &split, 1, kHalf);
+    vDSP_fft_zrip(sharedSetup(), &split, 1, kLogSize, FFT_FORWARD);
+    imagp[0] = 0.0f;
+
+    float scale = 1.0f / static_cast<float>(2 * kSize);
+    vDSP_vsmul(realp, 1, &scale, realp, 1, kHalf);
+    vDSP_vsmul(imagp, 1, &scale, imagp, 1, kHalf);
+}
+
+#elif defined(DETECTORS_FFT_FFTW)
+
+// One plan for every instance. Planning isn't thread safe but the static is only initialised once, and running
+// a plan on other arrays with fftwf_execute_dft_r2c is, as long as they're aligned like the ones it was made
+// for. The planning arrays are only needed while planning.
+static fftwf_plan sharedPlan() {
+    struct Plan {
+        fftwf_plan plan;
+        Plan() {
+            float *in = fftwf_alloc_real(kSize);
+            fftwf_complex *out = fftwf_alloc_complex(kHalf + 1);
+            plan = fftwf_plan_dft_r2c_1d(kSize, in, out, FFTW_ESTIMATE);
+            fftwf_free(in);
+            fftwf_free(out);
+        }
+    };
+    static const Plan plan;
+    return plan.plan;
+}
+
+RealFFT::RealFFT() {
+    fftTables();
+    sharedPlan();
+}
+
+void RealFFT::forward(const float *input, float *realp, float *imagp) {
+    const float *window = fftTables().window;
+    for(int i = 0; i < kSize; ++i) {
+        m_inReal[i] = input[i] * window[i];
+    }
+    fftwf_execute_dft_r2c(sharedPlan(), m_inReal, m_out);
+
+    // FFTW is unnormalised, vDSP's zrip is twice that and we then scale by 1/(2*kSize)
+    const float scale = 1.0f / static_cast<float>(kSize);
+    for(int k = 0; k < kHalf; ++k) {
+        realp[k] = m_out[k][0] * scale;
+        imagp[k] = m_out[k][1] * scale;
+    }
+    imagp[0] = 0.0f;
+}
+
+#else
+
+RealFFT::RealFFT() {
+    fftTables();
+}
+
+// One radix-2 stage's butterflies for a group: a += w*b, b = a - w*b with w walking the stage's twiddles.
+static inline void butterflies(float *aRe, float *aIm, float *bRe, float *bIm,
+                               const float *wRe, const float *wIm, int span) {
+    int j = 0;
+    for(; j + 4 <= span; j += 4) {
+        vec4 br = vec4_load(bRe+j), bi = vec4_load(bIm+j);
+        vec4 wr = vec4_load(wRe+j), wi = vec4_load(wIm+j);
+        vec4 tr = vec4_sub(vec4_mul(br, wr), vec4_mul(bi, wi));
+        vec4 ti = vec4_add(vec4_mul(br, wi), vec4_mul(bi, wr));
+        vec4 ar = vec4_load(aRe+j), ai = vec4_load(aIm+j);
+        vec4_store(bRe+j, vec4_sub(ar, tr));
+        vec4_store(bIm+j, vec4_sub(ai, ti));
+        vec4_store(aRe+j, vec4_add(ar, tr));
+        vec4_store(aIm+j, vec4_add(ai, ti));
+    }
+    for(; j < span; ++j) {
+        float tr = bRe[j] * wRe[j] - bIm[j] * wIm[j];
+        float ti = bRe[j] * wIm[j] + bIm[j] * wRe[j];
+        bRe[j] = aRe[j] - tr;
+        bIm[j] = aIm[j] - ti;
+        aRe[j] += tr;
+        aIm[j] += ti;
+    }
+}
+
+void RealFFT::forward(const float *input, float *realp, float *imagp) {
+    const FFTTables &t = fftTables();
+
+    // Treat the even samples as real and odd samples as imaginary parts of a half size complex signal,
+    // windowing and scattering into bit reversed order in the same pass.
+    for(int n = 0; n < kHalf; ++n) {
+        int dst = t.bitReverse[n];
+        m_re[dst] = input[2*n] * t.window[2*n];
+        m_im[dst] = input[2*n+1] * t.window[2*n+1];
+    }
+
+    // The first two stages have trivial twiddles (1 and -i) so do them together as radix-4 butterflies
+    for(int s = 0; s < kHalf; s += 4) {
+        float *re = m_re + s, *im = m_im + s;
+        float r0 = re[0] + re[1], i0 = im[0] + im[1];
+        float r1 = re[0] - re[1], i1 = im[0] - im[1];
+        float r2 = re[2] + re[3], i2 = im[2] + im[3];
+        float r3 = re[2] - re[3], i3 = im[2] - im[3];
+        re[0] = r0 + r2; im[0] = i0 + i2;
+        re[2] = r0 - r2; im[2] = i0 - i2;
+        // multiply (r3, i3) by -i
+        re[1] = r1 + i3; im[1] = i1 - r3;
+        re[3] = r1 - i3; im[3] = i1 + r3;
+    }
+    for(int span = 4; span < kHalf; span <<= 1) {
+        const float *wRe = t.stageRe + span - 1;
+        const float *wIm = t.stageIm + span - 1;
+        for(int s = 0; s < kHalf; s += 2*span) {
+            butterflies(m_re+s, m_im+s, m_re+s+span, m_im+s+span, wRe, wIm, span);
+        }
+    }
+
+    // Split the half size spectrum Z into the real spectrum X:
+    // X[k] = (Z[k] + conj(Z[N/2-k]))/2 - i*W^k*(Z[k] - conj(Z[N/2-k]))/2
+    // with the 1/kSize scale folded into the halves.
+    const float half = 0.5f / static_cast<float>(kSize);
+    realp[0] = (m_re[0] + m_im[0]) * (1.0f / static_cast<float>(kSize));
+    imagp[0] = 0.0f;
+    for(int k = 1; k < kHalf; ++k) {
+        float zr = m_re[k], zi = m_im[k];
+        float cr = m_re[kHalf-k], ci = -m_im[kHalf-k];
+        float evenRe = zr + cr, evenIm = zi + ci;
+        float oddRe = zi - ci, oddIm = cr - zr; // -i*(Z[k] - conj(Z[N/2-k]))
+        float wr = t.splitRe[k], wi = t.splitIm[k];
+        realp[k] = (evenRe + oddRe * wr - oddIm * wi) * half;
+        imagp[k] = (evenIm + oddRe * wi + oddIm * wr) * half;
+    }
+}
+
+RealFFT4::RealFFT4() {
+    fftTables();
+}
+
+void RealFFT4::power(const float *const *inputs, float *spectrum, int stride) {
+    const FFTTables &t = fftTables();
+    const int L = kLanes;
+
+    for(int n = 0; n < kHalf; ++n) {
+        int dst = t.bitReverse[n] * L;
+        for(int l = 0; l < L; ++l) {
+            m_re[dst + l] = inputs[l][2*n] * t.window[2*n];
+            m_im[dst + l] = inputs[l][2*n+1] * t.window[2*n+1];
+        }
+    }
+
+    for(int s = 0; s < kHalf; s += 4) {
+        float *re = m_re + s*L, *im = m_im + s*L;
+        vec4 re0 = vec4_load(re), re1 = vec4_load(re + L), re2 = vec4_load(re + 2*L), re3 = vec4_load(re + 3*L);
+        vec4 im0 = vec4_load(im), im1 = vec4_load(im + L), im2 = vec4_load(im + 2*L), im3 = vec4_load(im + 3*L);
+        vec4 r0 = vec4_add(re0, re1), i0 = vec4_add(im0, im1);
+        vec4 r1 = vec4_sub(re0, re1), i1 = vec4_sub(im0, im1);
+        vec4 r2 = vec4_add(re2, re3), i2 = vec4_add(im2, im3);
+        vec4 r3 = vec4_sub(re2, re3), i3 = vec4_sub(im2, im3);
+        vec4_store(re, vec4_add(r0, r2)); vec4_store(im, vec4_add(i0, i2));
+        vec4_store(re + 2*L, vec4_sub(r0, r2)); vec4_store(im + 2*L, vec4_sub(i0, i2));
+        vec4_store(re + L, vec4_add(r1, i3)); vec4_store(im + L, vec4_sub(i1, r3));
+        vec4_store(re + 3*L, vec4_sub(r1, i3)); vec4_store(im + 3*L, vec4_add(i1, r3));
+    }
+    for(int span = 4; span < kHalf; span <<= 1) {
+        const float *wRe = t.stageRe + span - 1;
+        const float *wIm = t.stageIm + span - 1;
+        for(int s = 0; s < kHalf; s += 2*span) {
+            float *aRe = m_re + s*L, *aIm = m_im + s*L;
+            float *bRe = aRe + span*L, *bIm = aIm + span*L;
+            for(int j = 0; j < span; ++j) {
+                vec4 wr = vec4_set1(wRe[j]), wi = vec4_set1(wIm[j]);
+                vec4 br = vec4_load(bRe + j*L), bi = vec4_load(bIm + j*L);
+                vec4 tr = vec4_sub(vec4_mul(br, wr), vec4_mul(bi, wi));
+                vec4 ti = vec4_add(vec4_mul(br, wi), vec4_mul(bi, wr));
+                vec4 ar = vec4_load(aRe + j*L), ai = vec4_load(aIm + j*L);
+                vec4_store(bRe + j*L, vec4_sub(ar, tr));
+                vec4_store(bIm + j*L, vec4_sub(ai, ti));
+                vec4_store(aRe + j*L, vec4_add(ar, tr));
+                vec4_store(aIm + j*L, vec4_add(ai, ti));
+            }
+        }
+    }
+
+    // the split into the real spectrum from RealFFT::forward, subtracting rather than adding the negated
+    // conjugate so every lane rounds the same way
+    const vec4 half = vec4_set1(0.5f / static_cast<float>(kSize));
+    vec4 dc = vec4_mul(vec4_add(vec4_load(m_re), vec4_load(m_im)), vec4_set1(1.0f / static_cast<float>(kSize)));
+    vec4_store(spectrum, vec4_mul(dc, dc));
+    for(int k = 1; k < kHalf; ++k) {
+        vec4 zr = vec4_load(m_re + k*L), zi = vec4_load(m_im + k*L);
+        vec4 cr = vec4_load(m_re + (kHalf-k)*L), ciNeg = vec4_load(m_im + (kHalf-k)*L);
+        vec4 evenRe = vec4_add(zr, cr), evenIm = vec4_sub(zi, ciNeg);
+        vec4 oddRe = vec4_add(zi, ciNeg), oddIm = vec4_sub(cr, zr);
+        vec4 wr = vec4_set1(t.splitRe[k]), wi = vec4_set1(t.splitIm[k]);
+        vec4 re = vec4_mul(vec4_sub(vec4_add(evenRe, vec4_mul(oddRe, wr)), vec4_mul(oddIm, wi)), half);
+        vec4 im = vec4_mul(vec4_add(vec4_add(evenIm, vec4_mul(oddRe, wi)), vec4_mul(oddIm, wr)), half);
+        vec4_store(spectrum + k*stride, vec4_add(vec4_mul(re, re), vec4_mul(im, im)));
+    }
+}
+
+#endif
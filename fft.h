@@ -0,0 +1,82 @@
+#ifndef _FFT_H_
+#define _FFT_H_
+
+// Windowed real FFT of one detector block. The backend is picked at compile time:
+//  * DETECTORS_FFT_VDSP uses Accelerate/vDSP, the default on Apple platforms
+//  * DETECTORS_FFT_FFTW uses FFTW's single precision real-to-complex plans (link with -lfftw3f)
+//  * DETECTORS_FFT_BUILTIN is a small self-contained split radix-2 FFT specialised for the block size,
+//    the default everywhere else
+// All backends produce the same output so the detector thresholds don't care which one is used.
+// Every backend keeps its buffers inline and shares its setup or plan between instances, so constructing one
+// never allocates once the first instance exists.
+
+#if !defined(DETECTORS_FFT_VDSP) && !defined(DETECTORS_FFT_FFTW) && !defined(DETECTORS_FFT_BUILTIN)
+#if defined(__APPLE__)
+#define DETECTORS_FFT_VDSP 1
+#else
+#define DETECTORS_FFT_BUILTIN 1
+#endif
+#endif
+
+#if defined(DETECTORS_FFT_VDSP)
+#include <Accelerate/Accelerate.h>
+#elif defined(DETECTORS_FFT_FFTW)
+#include <fftw3.h>
+#endif
+
+class RealFFT {
+public:
+    static const int kSize = 512;
+    static const int kLogSize = 9;
+    static const int kSpectrumSize = kSize / 2;
+
+    RealFFT();
+
+    // Applies a Hann window to kSize samples of input and writes the first kSpectrumSize bins in split form.
+    // The scaling matches vDSP_fft_zrip followed by a multiply by 1/(2*kSize), which is what the detectors
+    // were tuned with, and imagp[0] is zero rather than holding the Nyquist bin like vDSP packs it.
+    void forward(const float *input, float *realp, float *imagp);
+
+private:
+    RealFFT(const RealFFT &);
+    RealFFT &operator=(const RealFFT &);
+
+#if defined(DETECTORS_FFT_VDSP)
+    alignas(16) float m_inReal[kSize];
+#elif defined(DETECTORS_FFT_FFTW)
+    // aligned like fftwf_malloc'd arrays so the shared plan can run on them
+    alignas(64) float m_inReal[kSize];
+    alignas(64) fftwf_complex m_out[kSpectrumSize + 1];
+#else
+    // the half size complex FFT the real transform is built on, in bit reversed order until it runs
+    float m_re[kSpectrumSize];
+    float m_im[kSpectrumSize];
+#endif
+};
+
+#if defined(DETECTORS_FFT_BUILTIN)
+// The built in FFT for four blocks at once, interleaved so each lane of every vector op belongs to one block and
+// the op sequence per lane is the scalar one's, giving the same spectra as four RealFFT calls (unless the compiler
+// fuses the scalar split's multiply-adds, as some do for ARM, which can change the last bit). The other backends
+// have no batched equivalent with identical output, so only the built in one has this.
+class RealFFT4 {
+public:
+    static const int kLanes = 4;
+
+    RealFFT4();
+
+    // Windows kSize samples from each of the 4 inputs and writes the power spectrum |X[k]|^2 of input l to
+    // spectrum[k*stride + l] for the first RealFFT::kSpectrumSize bins
+    void power(const float *const *inputs, float *spectrum, int stride);
+
+private:
+    RealFFT4(const RealFFT4 &);
+    RealFFT4 &operator=(const RealFFT4 &);
+
+    // [bin][lane], in bit reversed order until it runs like RealFFT's
+    alignas(16) float m_re[RealFFT::kSpectrumSize * kLanes];
+    alignas(16) float m_im[RealFFT::kSpectrumSize * kLanes];
+};
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+#include "filterbank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+// Q of the two biquads making up a 4th order Butterworth filter, and of a 2nd order one
+static const double kButterworthQ[2] = {0.54119610014619701, 1.3065629648763766};
+static const double kButterworthQ2 = 0.70710678118654757;
+// How far inside a shared edge the elliptic filters' pass band ends, in bins. It puts their -3dB point on the edge
+// and their skirt within a few dB of the Hann window's over the next bin, like the band sums of the FFT.
+static const double kEllipticInset = 0.7;
+static const int kEllipticSections = 3;
+// Points the noise bandwidth of a band is integrated over
+static const int kNoiseSteps = 4096;
+// A DC offset far below anything audible that the high passes remove, it keeps the filter states from decaying
+// into denormals on digital silence, which would make the filters many times slower
+static const float kAntiDenormal = 1e-18f;
+
+namespace {
+struct Biquad {
+    double b0, b1, b2, a1, a2;
+};
+
+// Audio EQ cookbook low and high pass, normalised so a0 = 1
+Biquad lowPass(double freq, double q, double sampleRate) {
+    double w = 2.0 * M_PI * freq / sampleRate;
+    double alpha = sin(w) / (2.0 * q);
+    double a0 = 1.0 + alpha;
+    Biquad f = {(1.0 - cos(w)) / 2.0 / a0, (1.0 - cos(w)) / a0, (1.0 - cos(w)) / 2.0 / a0,
+                -2.0 * cos(w) / a0, (1.0 - alpha) / a0};
+    return f;
+}
+
+Biquad highPass(double freq, double q, double sampleRate) {
+    double w = 2.0 * M_PI * freq / sampleRate;
+    double alpha = sin(w) / (2.0 * q);
+    double a0 = 1.0 + alpha;
+    Biquad f = {(1.0 + cos(w)) / 2.0 / a0, -(1.0 + cos(w)) / a0, (1.0 + cos(w)) / 2.0 / a0,
+                -2.0 * cos(w) / a0, (1.0 - alpha) / a0};
+    return f;
+}
+
+const Biquad kPassThrough = {1.0, 0.0, 0.0, 0.0, 0.0};
+
+// Normalised 6th order elliptic low pass with 0.5dB of ripple and 40dB down in the stop band, from
+// scipy.signal.ellipap(6, 0.5, 40): each section's zero frequency and its pole in the upper half plane
+struct AnalogSection {
+    double zero;
+    double poleRe, poleIm;
+};
+
+const AnalogSection kElliptic[kEllipticSections] = {
+    {3.1568114238976115, -0.38503679665658613, 0.4114744502967013},
+    {1.3622529336712117, -0.15287525108369296, 0.8792730574438216},
+    {1.1443400815042173, -0.03251589915459846, 1.0065336408258416},
+};
+
+// One section of the elliptic prototype moved to freq through the prewarped bilinear transform, as a high pass
+// by mirroring it with s -> 1/s. Normalised to unity gain at DC or Nyquist, the band's noise bandwidth takes
+// care of its overall level.
+Biquad elliptic(const AnalogSection &proto, double freq, bool highPass, double sampleRate) {
+    double fs2 = 2.0 * sampleRate;
+    double wc = fs2 * tan(M_PI * freq / sampleRate);
+    std::complex<double> zero(0.0, proto.zero), pole(proto.poleRe, proto.poleIm);
+    if(highPass) {
+        zero = wc / zero;
+        pole = wc / pole;
+    } else {
+        zero *= wc;
+        pole *= wc;
+    }
+    std::complex<double> zd = (fs2 + zero) / (fs2 - zero), pd = (fs2 + pole) / (fs2 - pole);
+    Biquad f = {1.0, -2.0 * zd.real(), std::norm(zd), -2.0 * pd.real(), std::norm(pd)};
+    double at = highPass ? -1.0 : 1.0;
+    double gain = (1.0 + f.a1 * at + f.a2) / (f.b0 + f.b1 * at + f.b2);
+    f.b0 *= gain;
+    f.b1 *= gain;
+    f.b2 *= gain;
+    return f;
+}
+
+// Width in bins of a brick wall band letting through as much white noise (up to bandwidth) as the sections, so
+// dividing the band's energy by it gives white noise the level the FFT's band average has
+double noiseBins(const Biquad *sections, int count, double binWidth, double sampleRate, double bandwidth) {
+    double sum = 0.0;
+    double top = std::min(bandwidth / (sampleRate / 2.0), 1.0);
+    for(int i = 0; i < kNoiseSteps; ++i) {
+        std::complex<double> z1 = std::polar(1.0, -M_PI * top * (i + 0.5) / kNoiseSteps), z2 = z1 * z1;
+        double power = 1.0;
+        for(int s = 0; s < count; ++s) {
+            const Biquad &f = sections[s];
+            power *= std::norm((f.b0 + f.b1 * z1 + f.b2 * z2) / (1.0 + f.a1 * z1 + f.a2 * z2));
+        }
+        sum += power;
+    }
+    return sum / kNoiseSteps * top * (sampleRate / 2.0) / binWidth;
+}
+}
+
+void BandFilterbank::init(const size_t low[kBands], const size_t high[kBands], int fftSize, double sampleRate,
+                          double bandwidth) {
+    double binWidth = sampleRate / fftSize;
+    for(int band = 0; band < kBands; ++band) {
+        Biquad sections[kSections] = {kPassThrough, kPassThrough, kPassThrough, kPassThrough};
+        // bin k covers (k-0.5, k+0.5) bin widths, so that's where the band edges are
+        double lowEdge = (low[band] - 0.5) * binWidth;
+        double highEdge = (high[band] - 0.5) * binWidth;
+        bool lowShared = false, highShared = false;
+        for(int other = 0; other < kBands; ++other) {
+            lowShared = lowShared || high[other] == low[band];
+            highShared = highShared || low[other] == high[band];
+        }
+        bool lowPassed = static_cast<int>(high[band]) < fftSize / 2;
+        if(lowShared) {
+            for(int i = 0; i < kEllipticSections; ++i) {
+                sections[i] = elliptic(kElliptic[i], lowEdge + kEllipticInset * binWidth, true, sampleRate);
+            }
+            if(lowPassed) sections[kSections-1] = lowPass(highEdge, kButterworthQ2, sampleRate);
+        } else if(highShared && lowPassed) {
+            sections[0] = highPass(lowEdge, kButterworthQ2, sampleRate);
+            for(int i = 0; i < kEllipticSections; ++i) {
+                sections[1+i] = elliptic(kElliptic[i], highEdge - kEllipticInset * binWidth, false, sampleRate);
+            }
+        } else {
+            for(int i = 0; i < 2; ++i) sections[i] = highPass(lowEdge, kButterworthQ[i], sampleRate);
+            if(lowPassed) {
+                for(int i = 0; i < 2; ++i) sections[2+i] = lowPass(highEdge, kButterworthQ[i], sampleRate);
+            }
+        }
+        double bins = noiseBins(sections, kSections, binWidth, sampleRate, bandwidth);
+        m_scale[band] = static_cast<float>(1.0 / (2.0 * fftSize * bins));
+
+        float coeffs[5][kSections];
+        for(int s = 0; s < kSections; ++s) {
+            coeffs[0][s] = static_cast<float>(sections[s].b0);
+            coeffs[1][s] = static_cast<float>(sections[s].b1);
+            coeffs[2][s] = static_cast<float>(sections[s].b2);
+            coeffs[3][s] = static_cast<float>(sections[s].a1);
+            coeffs[4][s] = static_cast<float>(sections[s].a2);
+        }
+        m_b0[band] = vec4_load(coeffs[0]);
+        m_b1[band] = vec4_load(coeffs[1]);
+        m_b2[band] = vec4_load(coeffs[2]);
+        m_a1[band] = vec4_load(coeffs[3]);
+        m_a2[band] = vec4_load(coeffs[4]);
+    }
+    reset();
+}
+
+void BandFilterbank::reset() {
+    for(int band = 0; band < kBands; ++band) m_s1[band] = m_s2[band] = m_out[band] = vec4_set1(0.0f);
+    for(int h = 0; h < kHopsPerWindow; ++h) {
+        for(int band = 0; band < kBands; ++band) m_hopEnergy[h][band] = 0.0f;
+    }
+}
+
+// One sample through a band's wavefront of sections
+static inline void wavefrontStep(float sample, vec4 &out, vec4 &s1, vec4 &s2, vec4 &energy, const vec4 &b0,
+                                 const vec4 &b1, const vec4 &b2, const vec4 &a1, const vec4 &a2) {
+    vec4 x = vec4_shift_in(out, sample);
+    vec4 y = vec4_madd(b0, x, s1);
+    // ordered so the feedback through y is as short a chain as possible
+    s1 = vec4_sub(vec4_madd(b1, x, s2), vec4_mul(a1, y));
+    s2 = vec4_sub(vec4_mul(b2, x), vec4_mul(a2, y));
+    out = y;
+    energy = vec4_madd(y, y, energy);
+}
+
+void BandFilterbank::processHop(const float *samples, int count, float bands[kBands]) {
+    static_assert(kBands == 3, "the bands are unrolled below");
+    // the bands are written out so their states stay in registers and their steps overlap
+    vec4 out0 = m_out[0], s10 = m_s1[0], s20 = m_s2[0], e0 = vec4_set1(0.0f);
+    vec4 out1 = m_out[1], s11 = m_s1[1], s21 = m_s2[1], e1 = vec4_set1(0.0f);
+    vec4 out2 = m_out[2], s12 = m_s1[2], s22 = m_s2[2], e2 = vec4_set1(0.0f);
+    for(int i = 0; i < count; ++i) {
+        float sample = samples[i] + kAntiDenormal;
+        wavefrontStep(sample, out0, s10, s20, e0, m_b0[0], m_b1[0], m_b2[0], m_a1[0], m_a2[0]);
+        wavefrontStep(sample, out1, s11, s21, e1, m_b0[1], m_b1[1], m_b2[1], m_a1[1], m_a2[1]);
+        wavefrontStep(sample, out2, s12, s22, e2, m_b0[2], m_b1[2], m_b2[2], m_a1[2], m_a2[2]);
+    }
+    m_out[0] = out0; m_s1[0] = s10; m_s2[0] = s20;
+    m_out[1] = out1; m_s1[1] = s11; m_s2[1] = s21;
+    m_out[2] = out2; m_s1[2] = s12; m_s2[2] = s22;
+    const vec4 energy[kBands] = {e0, e1, e2};
+
+    for(int h = 0; h + 1 < kHopsPerWindow; ++h) {
+        for(int band = 0; band < kBands; ++band) m_hopEnergy[h][band] = m_hopEnergy[h+1][band];
+    }
+    // Mean of the squared Hann window over each quarter: (1.5 -+ 4/pi)/4 for the outer and inner quarters.
+    // Each quarter's energy is a sum rather than a mean so the quarter length is already folded in.
+    const float outer = static_cast<float>((1.5 - 4.0 / M_PI) / 4.0);
+    const float inner = static_cast<float>((1.5 + 4.0 / M_PI) / 4.0);
+    for(int band = 0; band < kBands; ++band) {
+        // only the last section's lane is the band's output, the others are intermediate signals
+        float lanes[4];
+        vec4_store(lanes, energy[band]);
+        float (*e)[kBands] = m_hopEnergy;
+        e[kHopsPerWindow-1][band] = lanes[kSections-1];
+        bands[band] = (outer * (e[0][band] + e[3][band]) + inner * (e[1][band] + e[2][band])) * m_scale[band];
+    }
+}
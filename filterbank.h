@@ -0,0 +1,51 @@
+#ifndef _FILTERBANK_H_
+#define _FILTERBANK_H_
+
+// Time domain alternative to the FFT for the "sss" detector's three band averages. Each band is four biquads.
+// Where two bands meet the FFT's band sums cross over within about a bin, so that edge gets a 6th order elliptic
+// filter in three of them, placed so it rolls off like the Hann window's leakage does, and the band's other edge
+// gets a 2nd order Butterworth in the fourth. A band with neither edge shared is a 4th order Butterworth high pass
+// into a 4th order low pass.
+//
+// By Parseval the sum of |X_k|^2 over a band of the detectors' Hann windowed, 1/N scaled spectrum equals the
+// window weighted energy of the band passed signal divided by 2N. The window weighting is approximated per hop
+// with the mean squared Hann weight of each quarter of the window, so each hop only has to add up the squared
+// filter outputs of its own samples. Each band is divided by its filters' noise bandwidth rather than its width
+// in bins, so white noise comes out at the same level as averaging the FFT bins, which is what the thresholds
+// were tuned on. The estimates still differ hop to hop, so decisions made right at a threshold can differ.
+
+#include <cstddef>
+
+#include "simd.h"
+
+class BandFilterbank {
+public:
+    static const int kBands = 3;
+    static const int kSections = 4;
+    static const int kHopsPerWindow = 4;
+
+    // Bands are given as FFT bin ranges [low, high) of a fftSize point FFT at sampleRate, a band reaching
+    // the last bin gets no low pass. bandwidth is how far up in Hz the input has anything in it, for input
+    // that was resampled from a lower rate.
+    void init(const size_t low[kBands], const size_t high[kBands], int fftSize, double sampleRate,
+              double bandwidth);
+    // Clears the filter states and energies as if only silence had been seen
+    void reset();
+
+    // Filters one hop of samples and writes the band averages for the window ending with it
+    void processHop(const float *samples, int count, float bands[kBands]);
+
+private:
+    // Every band's sections run as a wavefront with section i in lane i: each step feeds lane i the output lane
+    // i-1 produced the step before, so the four sections work on consecutive samples at once instead of waiting
+    // on each other. Outputs come out kSections-1 samples late, which shifts the hops by well under a millisecond.
+    // Transposed direct form II, so the state is two vectors per band.
+    vec4 m_b0[kBands], m_b1[kBands], m_b2[kBands], m_a1[kBands], m_a2[kBands];
+    vec4 m_s1[kBands], m_s2[kBands];
+    vec4 m_out[kBands]; // every section's latest output
+    // squared output of each band summed over each of the last kHopsPerWindow hops, oldest first
+    float m_hopEnergy[kHopsPerWindow][kBands];
+    float m_scale[kBands]; // 1/(2 * fftSize * noise bandwidth of the band in bins)
+};
+
+#endif
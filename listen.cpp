@@ -0,0 +1,140 @@
+// Live runner for the detectors: captures from an ALSA device (PipeWire and PulseAudio through their ALSA
+// plugins), or replays a WAV or raw float32 file or pipe as if it was one, through the capture pipeline from
+// capture.h. Prints events like popclick-bench plus how long after the end of their hop they reached us, and
+// on Ctrl-C or at the end of a file the pipeline's latency and drop counters.
+
+#include "capture.h"
+#include "detectors.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <time.h>
+
+using namespace std;
+
+static volatile sig_atomic_t gInterrupted = 0;
+
+static void onInterrupt(int) { gInterrupted = 1; }
+
+static const char *eventName(int code) {
+    if(code == TSS_START_CODE) return "tss_start";
+    if(code == TSS_STOP_CODE) return "tss_stop";
+    if(code == POP_CODE) return "pop";
+    return NULL;
+}
+
+static void printStats(capture_t *capture) {
+    capture_stats_t stats;
+    capture_stats(capture, &stats);
+    fprintf(stderr, "periods %llu, dropped %llu, xruns %llu, events %llu, dropped events %llu, ring high water %llu\n",
+            stats.periods, stats.droppedPeriods, stats.xruns, stats.events, stats.droppedEvents, stats.ringHighWater);
+    fprintf(stderr, "capture to detection ms p50 %.1f p99 %.1f max %.2f%s%s\n", stats.latencyP50Ms,
+            stats.latencyP99Ms, stats.latencyMaxMs, stats.pinned ? ", pinned" : "", stats.realtime ? ", realtime" : "");
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: popclick-listen [options] [input.wav | - | --raw input.f32 | --alsa DEVICE]\n"
+        "  --alsa DEVICE     capture from an ALSA device like default or hw:1, needs a build with make ALSA=1\n"
+        "  --raw             input is headerless mono float32 at --rate\n"
+        "  --realtime        feed the file at its sample rate like a live device\n"
+        "  --rate HZ         sample rate to capture at (default 44100, files with a header must match)\n"
+        "  --period N        samples per period read from the source (default 128)\n"
+        "  --periods N       periods in the device buffer (default 3)\n"
+        "  --ring N          periods queued between the capture and detector threads (default 64)\n"
+        "  --cpu N           pin the detector thread to core N\n"
+        "  --rt              ask for SCHED_FIFO for the capture and detector threads\n"
+        "  --engine NAME     fft (default) or filterbank\n"
+        "  --templates PATH  match the pop templates in a template pack instead of the built in one\n"
+        "  --quiet           don't print events\n");
+}
+
+int main(int argc, char **argv) {
+    capture_config_t captureConfig;
+    capture_default_config(&captureConfig);
+    captureConfig.source = CAPTURE_SOURCE_FILE;
+    detectors_config_t config;
+    detectors_default_config(&config);
+    const char *templatesPath = NULL;
+    bool quiet = false;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--alsa" && hasValue) { captureConfig.source = CAPTURE_SOURCE_ALSA; captureConfig.device = argv[++i]; }
+        else if(arg == "--raw" && hasValue) { captureConfig.rawFile = 1; captureConfig.device = argv[++i]; }
+        else if(arg == "--realtime") captureConfig.paceFile = 1;
+        else if(arg == "--rate" && hasValue) captureConfig.sampleRate = atoi(argv[++i]);
+        else if(arg == "--period" && hasValue) captureConfig.periodFrames = atoi(argv[++i]);
+        else if(arg == "--periods" && hasValue) captureConfig.devicePeriods = max(2, atoi(argv[++i]));
+        else if(arg == "--ring" && hasValue) captureConfig.ringPeriods = max(2, atoi(argv[++i]));
+        else if(arg == "--cpu" && hasValue) captureConfig.cpu = atoi(argv[++i]);
+        else if(arg == "--rt") captureConfig.realtime = 1;
+        else if(arg == "--templates" && hasValue) templatesPath = argv[++i];
+        else if(arg == "--engine" && hasValue && string(argv[i+1]) == "fft") { config.engine = DETECTORS_ENGINE_FFT; ++i; }
+        else if(arg == "--engine" && hasValue && string(argv[i+1]) == "filterbank") {
+            config.engine = DETECTORS_ENGINE_FILTERBANK;
+            ++i;
+        }
+        else if(arg == "--quiet") quiet = true;
+        else if((arg == "-" || arg[0] != '-') && !captureConfig.device) captureConfig.device = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if(!captureConfig.device) {
+        usage();
+        return 1;
+    }
+
+    pop_templates_t *templates = NULL;
+    if(templatesPath && !(templates = pop_templates_load(templatesPath))) {
+        fprintf(stderr, "%s is not a valid template pack\n", templatesPath);
+        return 1;
+    }
+    detectors_t *detectors = detectors_new_with_templates(captureConfig.sampleRate, &config, templates);
+    if(!detectors) {
+        fprintf(stderr, "Unsupported sample rate %dHz\n", captureConfig.sampleRate);
+        return 1;
+    }
+    // polled rather than notified, a millisecond of sleep between empty polls is plenty for printing
+    capture_t *capture = capture_new(detectors, &captureConfig, NULL, NULL);
+    if(!capture) return 1;
+    signal(SIGINT, onInterrupt);
+
+    capture_event_t events[64];
+    double rate = captureConfig.sampleRate;
+    while(!gInterrupted) {
+        bool finished = capture_finished(capture);
+        size_t n = capture_poll(capture, events, 64);
+        long long now = capture_now_ns();
+        for(size_t i = 0; i < n && !quiet; ++i) {
+            // shifted in unsigned so going past the top bit ends the loop instead of overflowing
+            unsigned bits = static_cast<unsigned>(events[i].events);
+            for(unsigned bit = 1; bit != 0 && bit <= bits; bit <<= 1) {
+                if(!(bits & bit)) continue;
+                int code = static_cast<int>(bit);
+                double latencyMs = (now - events[i].captureNs) / 1e6;
+                if(eventName(code)) printf("%.4f\t%s\t%.2fms\n", events[i].sample / rate, eventName(code), latencyMs);
+                else printf("%.4f\t%d\t%.2fms\n", events[i].sample / rate, code, latencyMs);
+            }
+        }
+        if(n) fflush(stdout);
+        // only done once the last events have been taken after everything was processed
+        if(finished && n == 0) break;
+        if(n == 0) {
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    printStats(capture);
+    // a pipe can leave the capture thread waiting on a read forever, so don't wait for it after Ctrl-C
+    if(gInterrupted) return 0;
+    capture_free(capture);
+    detectors_free(detectors);
+    if(templates) pop_templates_free(templates);
+    return 0;
+}
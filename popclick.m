@@ -4,13 +4,16 @@
 #import <Foundation/Foundation.h>
 #import <AudioToolbox/AudioQueue.h>
 #import <AudioToolbox/AudioFile.h>
+#include <mach/mach_time.h>
 
+#include "capture.h"
 #include "detectors.h"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdirect-ivar-access"
 
-#define NUM_BUFFERS 1
+// A few buffers in flight so the queue always has one to fill while we copy the last one out
+#define NUM_BUFFERS 3
 static const int kSampleRate = 44100;
 
 #define USERDATA_TAG "thume.popclick.listener"
@@ -27,14 +30,16 @@ typedef struct
 }RecordState;
 
 @interface Listener : NSObject
-- (Listener*)initPlugins;
+- (Listener*)initWithConfig:(const detectors_config_t*)config templates:(pop_templates_t*)templates;
+- (void)setConfig:(const detectors_config_t*)config;
+- (detectors_config_t*)config;
 - (void)setupAudioFormat:(AudioStreamBasicDescription*)format;
 - (void)startRecording;
 - (void)stopRecording;
-- (void)feedSamplesToEngine:(UInt32)audioDataBytesCapacity audioData:(void *)audioData;
+- (void)feedSamplesToEngine:(UInt32)audioDataByteSize audioData:(void *)audioData startTime:(const AudioTimeStamp *)startTime;
 - (RecordState*)recordState;
-- (void)runCallbackWithEvent: (NSNumber*)evNumber;
-- (void)mainThreadCallback: (NSUInteger)evNumber;
+- (void)drainEvents;
+- (void)runCallbackWithEvent: (int)evNumber;
 
 @property lua_State* L;
 @property int fn;
@@ -51,27 +56,67 @@ void AudioInputCallback(void * inUserData,  // Custom audio metadata
   RecordState * recordState = [rec recordState];
   if(!recordState->recording) return;
 
+  // copied into the capture ring before handing the buffer back, the detectors run on a thread of their own
+  [rec feedSamplesToEngine:inBuffer->mAudioDataByteSize audioData:inBuffer->mAudioData startTime:inStartTime];
   AudioQueueEnqueueBuffer(recordState->queue, inBuffer, 0, NULL);
-  [rec feedSamplesToEngine:inBuffer->mAudioDataBytesCapacity audioData:inBuffer->mAudioData];
+}
+
+// The capture's userdata instead of the listener itself. The detector thread can't form a weak reference to a
+// listener that's part way through deallocating, but it can always use this, which the listener keeps alive
+// until its capture is freed.
+@interface ListenerNotifier : NSObject
+@property (weak) Listener *listener;
+@end
+
+@implementation ListenerNotifier
+@end
+
+// Runs on the capture pipeline's detector thread, at most once per batch of events until they're drained
+static void listener_notify(void *userdata) {
+  ListenerNotifier *notifier = (__bridge ListenerNotifier *)userdata;
+  dispatch_async(dispatch_get_main_queue(), ^{
+    // nil once the listener is gone, its last events go with it
+    [notifier.listener drainEvents];
+  });
 }
 
 @implementation Listener {
   RecordState recordState;
   detectors_t *detectors;
+  capture_t *capture; // fed by the audio queue, only exists while recording
+  ListenerNotifier *notifier;
+  detectors_config_t config;
+  pop_templates_t *templates; // owned by the listener, NULL for the built in pop template
 }
 
-- (Listener*)initPlugins {
+- (Listener*)initWithConfig:(const detectors_config_t*)initialConfig templates:(pop_templates_t*)pack {
   self = [super init];
   if (self) {
     recordState.recording = false;
-    detectors = detectors_new();
+    config = *initialConfig;
+    templates = pack;
+    detectors = detectors_new_with_templates(kSampleRate, &config, templates);
+    capture = NULL;
+    notifier = [[ListenerNotifier alloc] init];
+    notifier.listener = self;
   }
   return self;
 }
 
+- (void)setConfig:(const detectors_config_t*)newConfig {
+  config = *newConfig;
+  // safe while the detector thread is processing, it's picked up at the start of the next period
+  detectors_set_config(detectors, &config);
+}
+
+- (detectors_config_t*)config {
+  return &config;
+}
+
 - (void)dealloc {
-  [self stopRecording]; // remove callbacks if not already stopped before deallocating
+  [self stopRecording]; // remove callbacks and stop the capture if not already stopped before deallocating
   detectors_free(detectors);
+  if (templates) pop_templates_free(templates);
 }
 
 - (RecordState*)recordState {
@@ -96,11 +141,22 @@ void AudioInputCallback(void * inUserData,  // Custom audio metadata
 
   recordState.currentFrame = 0;
 
+  // the detector thread only runs while recording, stopping joins it so no notification outlives the recording
+  capture_config_t captureConfig;
+  capture_default_config(&captureConfig);
+  captureConfig.sampleRate = kSampleRate;
+  capture = capture_new(detectors, &captureConfig, listener_notify, (__bridge void *)notifier);
+  if (!capture) {
+    NSLog(@"Error: Couldn't start the capture pipeline.");
+    return;
+  }
+
+  // a NULL run loop calls back on the queue's own thread, so buffers keep coming while the main thread is busy
   OSStatus status;
   status = AudioQueueNewInput(&recordState.dataFormat,
                               AudioInputCallback,
                               (__bridge void *)self,
-                              CFRunLoopGetCurrent(),
+                              NULL,
                               kCFRunLoopCommonModes,
                               0,
                               &recordState.queue);
@@ -117,6 +173,8 @@ void AudioInputCallback(void * inUserData,  // Custom audio metadata
     status = AudioQueueStart(recordState.queue, NULL);
   } else {
     NSLog(@"Error: Couldn't open audio queue.");
+    capture_free(capture);
+    capture = NULL;
   }
 }
 
@@ -132,35 +190,59 @@ void AudioInputCallback(void * inUserData,  // Custom audio metadata
 
   AudioQueueDispose(recordState.queue, true);
   AudioFileClose(recordState.audioFile);
+  // the queue is gone so nothing writes to the capture any more, events it hadn't handed over yet are dropped
+  capture_free(capture);
+  capture = NULL;
 }
-- (void)mainThreadCallback: (NSUInteger)evNumber {
-    [self performSelectorOnMainThread:@selector(runCallbackWithEvent:)
-      withObject:[NSNumber numberWithLong: evNumber] waitUntilDone:NO];
-}
-
-- (void)feedSamplesToEngine:(UInt32)audioDataBytesCapacity audioData:(void *)audioData {
-  int sampleCount = audioDataBytesCapacity / sizeof(float);
+- (void)feedSamplesToEngine:(UInt32)audioDataByteSize audioData:(void *)audioData startTime:(const AudioTimeStamp *)startTime {
+  int sampleCount = audioDataByteSize / sizeof(float);
   float *samples = (float*)audioData;
-  NSAssert(sampleCount == DETECTORS_BLOCK_SIZE, @"Incorrect buffer size");
 
-  int result = detectors_process(detectors, samples);
-  if((result & TSS_START_CODE) == TSS_START_CODE) {
-    [self mainThreadCallback: 1]; // Tss on
-  }
-  if((result & TSS_STOP_CODE) == TSS_STOP_CODE) {
-    [self mainThreadCallback: 2]; // Tss off
-  }
-  if((result & POP_CODE) == POP_CODE) {
-    [self mainThreadCallback: 3]; // Pop
+  // the capture pipeline times latency from the last sample, on the host clock steady_clock also counts
+  long long captureNs = 0;
+  if(startTime && (startTime->mFlags & kAudioTimeStampHostTimeValid)) {
+    static mach_timebase_info_data_t timebase;
+    if(timebase.denom == 0) mach_timebase_info(&timebase);
+    captureNs = (long long)(startTime->mHostTime * timebase.numer / timebase.denom) +
+                (long long)(sampleCount * 1e9 / kSampleRate);
   }
+  capture_write(capture, samples, sampleCount, captureNs);
 
   recordState.currentFrame += sampleCount;
 }
 
-- (void)runCallbackWithEvent: (NSNumber*)evNumber {
+- (void)drainEvents {
+  // a notification can still be queued on the main thread after recording stopped
+  if (!capture) return;
+  capture_event_t events[32];
+  size_t count;
+  do {
+    count = capture_poll(capture, events, 32);
+    for(size_t i = 0; i < count; ++i) {
+      int result = events[i].events;
+      if((result & TSS_START_CODE) == TSS_START_CODE) {
+        [self runCallbackWithEvent: 1]; // Tss on
+      }
+      if((result & TSS_STOP_CODE) == TSS_STOP_CODE) {
+        [self runCallbackWithEvent: 2]; // Tss off
+      }
+      if((result & POP_CODE) == POP_CODE) {
+        [self runCallbackWithEvent: 3]; // Pop
+      }
+      // templates from a pack with codes of their own are reported as their code
+      // shifted in unsigned so going past the top bit ends the loop instead of overflowing
+      unsigned bits = (unsigned)result;
+      for (unsigned code = POP_CODE << 1; code != 0 && code <= bits; code <<= 1) {
+        if(bits & code) [self runCallbackWithEvent: (int)code];
+      }
+    }
+  } while(count == 32);
+}
+
+- (void)runCallbackWithEvent: (int)evNumber {
   lua_State* L = self.L;
   lua_rawgeti(L, LUA_REGISTRYINDEX, self.fn);
-  lua_pushinteger(L, [evNumber intValue]);
+  lua_pushinteger(L, evNumber);
   lua_call(L, 1, 0);
 }
 @end
@@ -207,6 +289,52 @@ static int listener_start(lua_State* L) {
   return 1;
 }
 
+static lua_Number get_number_field(lua_State* L, int idx, const char* name, lua_Number def) {
+  lua_getfield(L, idx, name);
+  lua_Number value = luaL_optnumber(L, -1, def);
+  lua_pop(L, 1);
+  return value;
+}
+
+// Overrides the fields of config that are present in the table at idx, leaving the rest alone
+static void read_config(lua_State* L, int idx, detectors_config_t* config) {
+  luaL_checktype(L, idx, LUA_TTABLE);
+  config->tssSensitivity = get_number_field(L, idx, "tssSensitivity", config->tssSensitivity);
+  config->tssHysteresisFactor = get_number_field(L, idx, "tssHysteresisFactor", config->tssHysteresisFactor);
+  config->tssMinFrames = get_number_field(L, idx, "tssMinFrames", config->tssMinFrames);
+  config->tssMinFramesLong = get_number_field(L, idx, "tssMinFramesLong", config->tssMinFramesLong);
+  lua_getfield(L, idx, "tssDelayMatch");
+  if (!lua_isnil(L, -1)) config->tssDelayMatch = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  config->popSensitivity = get_number_field(L, idx, "popSensitivity", config->popSensitivity);
+  config->popMaxShiftUp = get_number_field(L, idx, "popMaxShiftUp", config->popMaxShiftUp);
+  config->popMaxShiftDown = get_number_field(L, idx, "popMaxShiftDown", config->popMaxShiftDown);
+  config->popDebounceFrames = get_number_field(L, idx, "popDebounceFrames", config->popDebounceFrames);
+  lua_getfield(L, idx, "engine");
+  if (lua_isstring(L, -1)) {
+    config->engine = strcmp(lua_tostring(L, -1), "filterbank") == 0 ? DETECTORS_ENGINE_FILTERBANK : DETECTORS_ENGINE_FFT;
+  }
+  lua_pop(L, 1);
+}
+
+/// thume.popclick.listener:config(config) -> self
+/// Method
+/// Changes the detector tuning, even while the listener is running.
+///
+/// Parameters:
+///  * A table of settings to change, with the same keys as `thume.popclick.new`. Settings not in the table keep their current values.
+///
+/// Returns:
+///  * The `thume.popclick.listener` object
+static int listener_config(lua_State* L) {
+  Listener* listener = get_listener_arg(L, 1);
+  detectors_config_t config = *[listener config];
+  read_config(L, 2, &config);
+  [listener setConfig:&config];
+  lua_settop(L,1);
+  return 1;
+}
+
 static int listener_eq(lua_State* L) {
   Listener* listenA = get_listener_arg(L, 1);
   Listener* listenB = get_listener_arg(L, 2);
@@ -222,20 +350,44 @@ void new_listener(lua_State* L, Listener* listener) {
   lua_setmetatable(L, -2);
 }
 
-/// thume.popclick.new(fn) -> listener
+/// thume.popclick.new(fn[, config]) -> listener
 /// Method
 /// Creates a new listener for mouth noise recognition
 ///
 /// Parameters:
 ///  * A function that is called when a mouth noise is recognized. It should accept a single parameter which will be a number representing the event type.
+///  * An optional table of tuning settings, any that are left out keep their defaults:
+///   * tssSensitivity - how much louder the "sss" band has to be than the bands around it (default 5)
+///   * tssHysteresisFactor - fraction of tssSensitivity needed to keep matching once started (default 0.4)
+///   * tssMinFrames - 3ms frames of "sss" before it's reported (default 20)
+///   * tssMinFramesLong - frames before a delayed match is reported (default 100)
+///   * tssDelayMatch - hold back "sss" starts so two short ones in a row can be reported together (default false)
+///   * popSensitivity - largest template distance that counts as a pop, higher is more sensitive (default 8.5)
+///   * popMaxShiftUp, popMaxShiftDown - how far in frequency a pop can be from the template (default 2 and 4, at most 4 and 6)
+///   * popDebounceFrames - frames after a pop before another can be reported (default 15)
+///   * engine - "fft" or "filterbank", which uses much less CPU when it's mostly quiet (default "fft", can't be changed later)
+///   * templates - path to a template pack from popclick-templates to match instead of the built in pop template, its templates report `3` for pops and their own event code otherwise (can't be changed later)
 ///
 /// Returns:
 ///  * A `thume.popclick.listener` object
 static int listener_new(lua_State* L) {
   luaL_checktype(L, 1, LUA_TFUNCTION);
+  detectors_config_t config;
+  detectors_default_config(&config);
+  pop_templates_t *templates = NULL;
+  if (!lua_isnoneornil(L, 2)) {
+    read_config(L, 2, &config);
+    lua_getfield(L, 2, "templates");
+    if (lua_isstring(L, -1)) {
+      templates = pop_templates_load(lua_tostring(L, -1));
+      if (!templates) return luaL_error(L, "couldn't load the template pack %s", lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 1); // luaL_ref takes the function off the top of the stack
   int fn = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  Listener *listener = [[Listener alloc] initPlugins];
+  Listener *listener = [[Listener alloc] initWithConfig:&config templates:templates];
   listener.fn = fn;
   listener.L = L;
   new_listener(L, listener);
@@ -246,6 +398,7 @@ static const luaL_Reg popclicklib[] = {
   {"new", listener_new},
   {"stop", listener_stop},
   {"start", listener_start},
+  {"config", listener_config},
 
   {NULL, NULL} // necessary sentinel
 };
@@ -0,0 +1,191 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include "simd.h"
+
+static const double kKaiserBeta = 4.55; // about 50dB of stopband attenuation, plenty for band energies
+static const double kKaiserAttenuation = kKaiserBeta / 0.1102 + 8.7; // dB, Kaiser's formula for beta solved for it
+// Where the low pass is centred as a fraction of the lower of the two rates. Low enough that the transition
+// band mostly clears that rate's Nyquist frequency, the detectors don't look at anything that close anyway.
+static const double kCutoff = 0.45;
+
+static int gcd(int a, int b) {
+    while(b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for(int k = 1; k < 50; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if(term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+static int numTapsFor(int up, int down) {
+    return (Resampler::kTaps * std::max(up, down) / up + 7) / 8 * 8;
+}
+
+// Windowed sinc taps for converting inRate to outRate, reduced to up/down, split into phases
+static void designTaps(int inRate, int outRate, int up, int numTaps, std::vector<float> &taps) {
+    const int length = numTaps * up;
+    const double center = (length - 1) / 2.0;
+    // cutoff in cycles per sample of the virtual stream upsampled by up
+    const double fc = kCutoff * std::min(inRate, outRate) / (static_cast<double>(inRate) * up);
+    const double windowNorm = besselI0(kKaiserBeta);
+
+    std::vector<double> prototype(length);
+    for(int i = 0; i < length; ++i) {
+        double x = i - center;
+        double sinc = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+        double r = x / (center + 1.0);
+        prototype[i] = sinc * besselI0(kKaiserBeta * sqrt(std::max(0.0, 1.0 - r * r))) / windowNorm;
+    }
+
+    taps.resize(static_cast<size_t>(up) * numTaps);
+    for(int p = 0; p < up; ++p) {
+        // normalise every phase to unity gain at DC so a constant input stays exactly constant
+        double sum = 0.0;
+        for(int j = 0; j < numTaps; ++j) sum += prototype[p + j*up];
+        float *phase = &taps[static_cast<size_t>(p) * numTaps];
+        for(int j = 0; j < numTaps; ++j) {
+            phase[numTaps-1-j] = static_cast<float>(prototype[p + j*up] / sum);
+        }
+    }
+}
+
+namespace {
+struct SharedTaps {
+    int inRate;
+    int outRate;
+    std::vector<float> taps;
+};
+}
+
+// The taps for a pair of rates, designed on first use. Programs only ever see a handful of sample rates so the
+// filters are kept until exit, and a list never moves the ones already handed out.
+static const float *sharedTaps(int inRate, int outRate, int up, int numTaps) {
+    static std::mutex mutex;
+    static std::list<SharedTaps> filters;
+    std::lock_guard<std::mutex> lock(mutex);
+    for(std::list<SharedTaps>::iterator it = filters.begin(); it != filters.end(); ++it) {
+        if(it->inRate == inRate && it->outRate == outRate) return &it->taps[0];
+    }
+    SharedTaps filter;
+    filter.inRate = inRate;
+    filter.outRate = outRate;
+    filters.push_back(filter);
+    designTaps(inRate, outRate, up, numTaps, filters.back().taps);
+    return &filters.back().taps[0];
+}
+
+Resampler::Resampler() : m_up(1), m_down(1), m_numTaps(0), m_passband(0.5), m_cutoff(0.5), m_taps(NULL),
+    m_fill(0), m_end(0), m_phase(0) {}
+
+bool Resampler::supported(int inRate, int outRate) {
+    if(inRate <= 0 || outRate <= 0) return false;
+    int divisor = gcd(inRate, outRate);
+    int up = outRate / divisor, down = inRate / divisor;
+    return up <= kMaxPhases && (up == down || numTapsFor(up, down) <= kMaxTaps);
+}
+
+bool Resampler::init(int inRate, int outRate) {
+    if(!supported(inRate, outRate)) return false;
+    int divisor = gcd(inRate, outRate);
+    m_up = outRate / divisor;
+    m_down = inRate / divisor;
+    m_taps = NULL;
+    if(passthrough()) {
+        m_numTaps = 0;
+        m_passband = 0.5;
+        m_cutoff = 0.5;
+        return true;
+    }
+
+    m_numTaps = numTapsFor(m_up, m_down);
+    // Kaiser's estimate of the transition band width for this many taps, which the cutoff sits in the middle of
+    double transition = (kKaiserAttenuation - 7.95) / (2.285 * 2.0 * M_PI * m_numTaps) * inRate;
+    m_cutoff = kCutoff * std::min(inRate, outRate) / outRate;
+    m_passband = m_cutoff - transition / 2.0 / outRate;
+    m_taps = sharedTaps(inRate, outRate, m_up, m_numTaps);
+    // silence before the stream, and the first output waits for the first sample
+    std::fill(m_history, m_history + m_numTaps, 0.0f);
+    m_fill = m_numTaps;
+    m_end = m_numTaps + 1;
+    m_phase = 0;
+    return true;
+}
+
+size_t Resampler::process(const float *in, size_t inCount, float *out, size_t maxOut, size_t &used) {
+    used = 0;
+    if(passthrough()) {
+        size_t n = std::min(inCount, maxOut);
+        std::copy(in, in + n, out);
+        used = n;
+        return n;
+    }
+
+    // In locals, the compiler can't tell the stores to out don't change the members. Whole steps of input per
+    // output plus a carry out of the phase, so moving along never branches on whether an input sample is due.
+    const int up = m_up, numTaps = m_numTaps, whole = m_down / m_up, fraction = m_down % m_up;
+    float *history = m_history;
+    int fill = m_fill, end = m_end, phase = m_phase;
+    size_t produced = 0;
+    while(produced < maxOut) {
+        if(end > fill) {
+            // slide the window the next output needs to the front and take in only as much input as the outputs
+            // still wanted need, so no more is consumed than one sample at a time would have
+            if(used == inCount) break;
+            int start = end - numTaps;
+            std::copy(history + start, history + fill, history);
+            fill -= start;
+            end -= start;
+            unsigned long long last = end + (phase + static_cast<unsigned long long>(maxOut - produced - 1) * m_down)
+                                            / up;
+            size_t n = std::min(std::min(static_cast<size_t>(kMaxTaps + kChunk - fill), inCount - used),
+                                static_cast<size_t>(last - fill));
+            std::copy(in + used, in + used + n, history + fill);
+            fill += static_cast<int>(n);
+            used += n;
+            if(end > fill) break;
+        }
+        const float *taps = m_taps;
+        for(; produced < maxOut && end <= fill; ++produced) {
+            const float *hist = history + end - numTaps;
+            const float *phaseTaps = taps + static_cast<size_t>(phase) * numTaps;
+            // two accumulators so consecutive adds don't wait on each other
+            vec4 acc0 = vec4_set1(0.0f), acc1 = vec4_set1(0.0f);
+            for(int j = 0; j < numTaps; j += 8) {
+                acc0 = vec4_add(acc0, vec4_mul(vec4_load(hist + j), vec4_load(phaseTaps + j)));
+                acc1 = vec4_add(acc1, vec4_mul(vec4_load(hist + j + 4), vec4_load(phaseTaps + j + 4)));
+            }
+            out[produced] = vec4_hsum(vec4_add(acc0, acc1));
+            phase += fraction;
+            int carry = phase >= up;
+            phase -= carry ? up : 0;
+            end += whole + carry;
+        }
+    }
+    m_fill = fill;
+    m_end = end;
+    m_phase = phase;
+    return produced;
+}
+
+unsigned long long Resampler::inputPosition(unsigned long long outPosition) const {
+    if(outPosition == 0) return 0;
+    // output sample n is computed once input sample floor(n*M/L) has arrived
+    return (outPosition - 1) * m_down / m_up + 1;
+}
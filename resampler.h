@@ -0,0 +1,61 @@
+#ifndef _RESAMPLER_H_
+#define _RESAMPLER_H_
+
+// Polyphase FIR resampler converting a mono stream from any common sample rate to the rate the detectors
+// were tuned at. The ratio is reduced to outRate/inRate = L/M and each output sample is a dot product of the
+// newest input samples with one of L phases of a Kaiser windowed sinc low pass, so the cost per output sample
+// doesn't depend on how awkward the ratio is. Equal rates pass straight through with no filtering.
+// The filter only depends on the rates, so it's built the first time any resampler needs them and then shared.
+// Everything else is inline, so once a pair of rates has been seen init never allocates.
+
+#include <cstddef>
+
+class Resampler {
+public:
+    // Taps per phase when upsampling. Downsampling scales this by M/L so the transition band stays the same
+    // width relative to the output rate. Always rounded up to a multiple of 8 for the SIMD dot product.
+    static const int kTaps = 24;
+    static const int kMaxPhases = 1024;
+    // enough for downsampling from about 290kHz to 44.1kHz
+    static const int kMaxTaps = 160;
+    // input samples taken in at a time past the history the next output needs
+    static const int kChunk = 256;
+
+    Resampler();
+
+    // Returns false if either rate is invalid or the reduced ratio would need more than kMaxPhases phases or
+    // more than kMaxTaps taps
+    bool init(int inRate, int outRate);
+    static bool supported(int inRate, int outRate);
+    bool passthrough() const { return m_up == 1 && m_down == 1; }
+    // The highest frequency that comes through unattenuated, as a fraction of the output rate
+    double passband() const { return m_passband; }
+    // Where the low pass is half way down its transition band, as a fraction of the output rate. White noise
+    // comes out with about as much energy as if everything below this had been kept and nothing above it.
+    double cutoff() const { return m_cutoff; }
+
+    // Resamples up to inCount samples into out, stopping early once maxOut samples have been written.
+    // Sets used to how many input samples were consumed and returns how many output samples were written.
+    size_t process(const float *in, size_t inCount, float *out, size_t maxOut, size_t &used);
+
+    // How many input samples had been consumed when the output sample before outPosition was produced,
+    // for mapping output positions back to the caller's timeline
+    unsigned long long inputPosition(unsigned long long outPosition) const;
+
+private:
+    int m_up;
+    int m_down;
+    int m_numTaps;
+    double m_passband;
+    double m_cutoff;
+    // shared [phase][m_numTaps], each phase reversed so it lines up with the oldest sample first
+    const float *m_taps;
+    // Input in a straight line, so a whole chunk is copied in at once and outputs only have to move along it.
+    // The next output's window is the m_numTaps samples ending at m_end, which can be past m_fill.
+    alignas(16) float m_history[kMaxTaps + kChunk];
+    int m_fill;
+    int m_end;
+    int m_phase; // position of the next output sample between input samples in units of 1/m_up
+};
+
+#endif
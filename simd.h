@@ -0,0 +1,99 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+// A tiny 4 lane float vector wrapper so the few hot loops in the detectors can be written once and
+// compiled to SSE on x86, NEON on ARM, or plain scalar code anywhere else.
+// Loads and stores are unaligned since none of the callers can promise more than float alignment.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef __FMA__
+#include <immintrin.h>
+#endif
+#define DETECTORS_SIMD_SSE 1
+
+typedef __m128 vec4;
+static inline vec4 vec4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vec4_store(float *p, vec4 v) { _mm_storeu_ps(p, v); }
+static inline vec4 vec4_set1(float x) { return _mm_set1_ps(x); }
+static inline vec4 vec4_add(vec4 a, vec4 b) { return _mm_add_ps(a, b); }
+static inline vec4 vec4_sub(vec4 a, vec4 b) { return _mm_sub_ps(a, b); }
+static inline vec4 vec4_mul(vec4 a, vec4 b) { return _mm_mul_ps(a, b); }
+// a*b + c, fused where the target has it so it's one instruction with one rounding
+#ifdef __FMA__
+static inline vec4 vec4_madd(vec4 a, vec4 b, vec4 c) { return _mm_fmadd_ps(a, b, c); }
+#else
+static inline vec4 vec4_madd(vec4 a, vec4 b, vec4 c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+#endif
+static inline vec4 vec4_max(vec4 a, vec4 b) { return _mm_max_ps(a, b); }
+static inline vec4 vec4_min(vec4 a, vec4 b) { return _mm_min_ps(a, b); }
+static inline vec4 vec4_abs(vec4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+// {x, v[0], v[1], v[2]}
+static inline vec4 vec4_shift_in(vec4 v, float x) {
+    return _mm_move_ss(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 1, 0, 0)), _mm_set_ss(x));
+}
+static inline float vec4_hsum(vec4 v) {
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+static inline float vec4_hmax(vec4 v) {
+    __m128 m = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    return _mm_cvtss_f32(m);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DETECTORS_SIMD_NEON 1
+
+typedef float32x4_t vec4;
+static inline vec4 vec4_load(const float *p) { return vld1q_f32(p); }
+static inline void vec4_store(float *p, vec4 v) { vst1q_f32(p, v); }
+static inline vec4 vec4_set1(float x) { return vdupq_n_f32(x); }
+static inline vec4 vec4_add(vec4 a, vec4 b) { return vaddq_f32(a, b); }
+static inline vec4 vec4_sub(vec4 a, vec4 b) { return vsubq_f32(a, b); }
+static inline vec4 vec4_mul(vec4 a, vec4 b) { return vmulq_f32(a, b); }
+#ifdef __aarch64__
+static inline vec4 vec4_madd(vec4 a, vec4 b, vec4 c) { return vfmaq_f32(c, a, b); }
+#else
+static inline vec4 vec4_madd(vec4 a, vec4 b, vec4 c) { return vmlaq_f32(c, a, b); }
+#endif
+static inline vec4 vec4_max(vec4 a, vec4 b) { return vmaxq_f32(a, b); }
+static inline vec4 vec4_min(vec4 a, vec4 b) { return vminq_f32(a, b); }
+static inline vec4 vec4_abs(vec4 a) { return vabsq_f32(a); }
+static inline vec4 vec4_shift_in(vec4 v, float x) { return vextq_f32(vdupq_n_f32(x), v, 3); }
+static inline float vec4_hsum(vec4 v) {
+    float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+static inline float vec4_hmax(vec4 v) {
+    float32x2_t m = vmax_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpmax_f32(m, m), 0);
+}
+
+#else
+#include <cmath>
+
+struct vec4 { float v[4]; };
+static inline vec4 vec4_load(const float *p) { vec4 r = {{p[0], p[1], p[2], p[3]}}; return r; }
+static inline void vec4_store(float *p, vec4 a) { p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+static inline vec4 vec4_set1(float x) { vec4 r = {{x, x, x, x}}; return r; }
+static inline vec4 vec4_add(vec4 a, vec4 b) { for(int i = 0; i < 4; ++i) a.v[i] += b.v[i]; return a; }
+static inline vec4 vec4_sub(vec4 a, vec4 b) { for(int i = 0; i < 4; ++i) a.v[i] -= b.v[i]; return a; }
+static inline vec4 vec4_mul(vec4 a, vec4 b) { for(int i = 0; i < 4; ++i) a.v[i] *= b.v[i]; return a; }
+static inline vec4 vec4_madd(vec4 a, vec4 b, vec4 c) { for(int i = 0; i < 4; ++i) c.v[i] += a.v[i] * b.v[i]; return c; }
+static inline vec4 vec4_max(vec4 a, vec4 b) { for(int i = 0; i < 4; ++i) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return a; }
+static inline vec4 vec4_min(vec4 a, vec4 b) { for(int i = 0; i < 4; ++i) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return a; }
+static inline vec4 vec4_abs(vec4 a) { for(int i = 0; i < 4; ++i) a.v[i] = std::fabs(a.v[i]); return a; }
+static inline vec4 vec4_shift_in(vec4 a, float x) { vec4 r = {{x, a.v[0], a.v[1], a.v[2]}}; return r; }
+static inline float vec4_hsum(vec4 a) { return (a.v[0] + a.v[1]) + (a.v[2] + a.v[3]); }
+static inline float vec4_hmax(vec4 a) {
+    float m0 = a.v[0] > a.v[1] ? a.v[0] : a.v[1];
+    float m1 = a.v[2] > a.v[3] ? a.v[2] : a.v[3];
+    return m0 > m1 ? m0 : m1;
+}
+#endif
+
+#endif
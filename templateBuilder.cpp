@@ -0,0 +1,350 @@
+// Builds pop template packs (see templatePack.h) from labelled recordings. Every recording goes through the same
+// resampling, FFT and pop history columns the detectors use, each labelled example is cut out of that with its
+// loudest column where the built in template has its peak, and the examples of each label are averaged into a
+// template reporting its own event code.
+//
+// Labels are the bench's ground truth format, "<seconds> <name>" per line. pop (or 4) labels learn a template
+// reporting POP_CODE, any other name gets the next free code from 8 up in the order names are first seen.
+// tss_start and tss_stop labels are ignored.
+
+#include "audioFile.h"
+#include "detectorsCommon.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How far around a label to look for the loudest column of the example
+static const double kSearchBefore = 0.03;
+static const double kSearchAfter = 0.25;
+// How many hops either way of the ideal alignment the detectors get to see a pop at while it scrolls through
+static const int kAlignSlack = 3;
+// Learned sensitivities are the farthest example from its template times this
+static const float kDefaultMargin = 1.2f;
+
+struct Hop {
+    double time; // seconds into the recording at the end of the hop
+    float column[kBufferHeight];
+};
+
+struct TemplateClass {
+    string name;
+    int code;
+    vector<vector<float> > examples; // kBufferSize cells each, scaled to a max of 1
+    vector<float> cells;
+    float sensitivity;
+};
+
+// Runs a recording through the detectors and keeps every column pushed into the pop history
+class ColumnRecorder : public Detectors {
+public:
+    void record(const float *samples, size_t count, double sampleRate, vector<Hop> &hops) {
+        for(size_t i = 0; i < count; ++i) {
+            int cursor = m_popCursor;
+            push(samples+i, 1, NULL, NULL);
+            if(m_popCursor == cursor) continue;
+            float column[kPopStride] = {0};
+            popColumn(column);
+            Hop hop;
+            hop.time = m_resampler.inputPosition(m_samplesPushed) / sampleRate;
+            copy(column, column+kBufferHeight, hop.column);
+            hops.push_back(hop);
+        }
+    }
+};
+
+static float columnSum(const float *column) {
+    float sum = 0.0f;
+    for(int bin = 0; bin < kBufferHeight; ++bin) sum += column[bin];
+    return sum;
+}
+
+// The column of the built in template with the most energy, where every learned template gets its peak too so
+// they're all detected about as late after the sound
+static int templatePeakColumn() {
+    int peak = 0;
+    for(int col = 1; col < kBufferWidth; ++col) {
+        if(columnSum(kPopTemplate + col*kBufferHeight) > columnSum(kPopTemplate + peak*kBufferHeight)) peak = col;
+    }
+    return peak;
+}
+
+// kBufferWidth columns from first scaled so the largest cell is 1, or empty if they're silent
+static vector<float> window(const vector<Hop> &hops, int first) {
+    vector<float> cells(kBufferSize);
+    float maxVal = 0.0f;
+    for(int col = 0; col < kBufferWidth; ++col) {
+        copy(hops[first+col].column, hops[first+col].column+kBufferHeight, &cells[col*kBufferHeight]);
+    }
+    for(int i = 0; i < kBufferSize; ++i) maxVal = max(maxVal, cells[i]);
+    if(!(maxVal > 0.0f)) return vector<float>();
+    for(int i = 0; i < kBufferSize; ++i) cells[i] /= maxVal;
+    return cells;
+}
+
+// The distance the detectors would compute between a window and a template at its closest shift
+static float distance(const vector<float> &cells, const PopTemplate &templ) {
+    float best = INFINITY;
+    for(int s = templ.firstShift; s < templ.firstShift + templ.numShifts; ++s) {
+        float diff = 0.0f;
+        for(int col = 0; col < kBufferWidth; ++col) {
+            const float *t = templ.table->cells[s][col];
+            // the low bins aren't matched, the table has zeros there and so does the pop history
+            for(int bin = 0; bin < kBufferHeight; ++bin) {
+                diff += fabs(t[bin] - (bin < kPopStartBin ? 0.0f : cells[col*kBufferHeight+bin]));
+            }
+        }
+        best = min(best, diff);
+    }
+    return best;
+}
+
+// Like distance but also trying the windows a few hops either side, as the detectors see every one of them
+static float bestDistance(const vector<Hop> &hops, int first, const PopTemplate &templ) {
+    float best = INFINITY;
+    for(int d = -kAlignSlack; d <= kAlignSlack; ++d) {
+        if(first + d < 0 || first + d + kBufferWidth > static_cast<int>(hops.size())) continue;
+        vector<float> cells = window(hops, first + d);
+        if(!cells.empty()) best = min(best, distance(cells, templ));
+    }
+    return best;
+}
+
+struct Recording {
+    vector<Hop> hops;
+    vector<pair<int, size_t> > examples; // first column of each example and its class
+};
+
+static int classFor(const char *name, vector<TemplateClass> &classes) {
+    if(strcmp(name, "tss_start") == 0 || strcmp(name, "tss_stop") == 0 || strcmp(name, "1") == 0 ||
+       strcmp(name, "2") == 0) {
+        return -1;
+    }
+    string key = strcmp(name, "4") == 0 ? "pop" : name;
+    for(size_t c = 0; c < classes.size(); ++c) {
+        if(classes[c].name == key) return static_cast<int>(c);
+    }
+    // codes are shifted in unsigned since the next one up from 1 << 30 would overflow an int
+    unsigned code = POP_CODE << 1;
+    for(size_t c = 0; c < classes.size(); ++c) {
+        if(static_cast<unsigned>(classes[c].code) >= code) code = static_cast<unsigned>(classes[c].code) << 1;
+    }
+    if(key != "pop" && (code == 0 || code > (1u << 30))) {
+        fprintf(stderr, "Too many different labels, %s doesn't get an event code\n", name);
+        return -1;
+    }
+    TemplateClass templ;
+    templ.name = key;
+    templ.code = key == "pop" ? POP_CODE : static_cast<int>(code);
+    templ.sensitivity = 0.0f;
+    classes.push_back(templ);
+    return static_cast<int>(classes.size() - 1);
+}
+
+static bool loadRecording(const char *wavPath, const char *labelsPath, vector<TemplateClass> &classes,
+                          Recording &recording) {
+    SampleReader reader;
+    if(!reader.open(wavPath, false)) return false;
+    ColumnRecorder *recorder = new ColumnRecorder();
+    detectors_config_t config;
+    detectors_default_config(&config);
+    if(!recorder->initialise(static_cast<int>(reader.sampleRate()), config)) {
+        fprintf(stderr, "%s: unsupported sample rate %.0fHz\n", wavPath, reader.sampleRate());
+        delete recorder;
+        return false;
+    }
+    float block[DETECTORS_BLOCK_SIZE];
+    size_t got;
+    while((got = reader.read(block, DETECTORS_BLOCK_SIZE)) > 0) {
+        recorder->record(block, got, reader.sampleRate(), recording.hops);
+    }
+    delete recorder;
+
+    FILE *f = fopen(labelsPath, "r");
+    if(!f) {
+        fprintf(stderr, "Can't open labels %s\n", labelsPath);
+        return false;
+    }
+    const int peakColumn = templatePeakColumn();
+    const int numHops = static_cast<int>(recording.hops.size());
+    char line[256];
+    while(fgets(line, sizeof(line), f)) {
+        double time;
+        char name[64];
+        if(line[0] == '#' || sscanf(line, "%lf %63s", &time, name) != 2) continue;
+        int c = classFor(name, classes);
+        if(c < 0) continue;
+        int peak = -1;
+        for(int h = 0; h < numHops; ++h) {
+            const Hop &hop = recording.hops[h];
+            if(hop.time < time - kSearchBefore || hop.time > time + kSearchAfter) continue;
+            if(peak < 0 || columnSum(hop.column) > columnSum(recording.hops[peak].column)) peak = h;
+        }
+        int first = peak - peakColumn;
+        if(peak < 0 || first < 0 || first + kBufferWidth > numHops) {
+            fprintf(stderr, "%s: skipping %s at %.3f, too close to the ends of the recording\n", wavPath, name, time);
+            continue;
+        }
+        vector<float> cells = window(recording.hops, first);
+        if(cells.empty()) {
+            fprintf(stderr, "%s: skipping %s at %.3f, it's silent\n", wavPath, name, time);
+            continue;
+        }
+        classes[c].examples.push_back(cells);
+        recording.examples.push_back(make_pair(first, static_cast<size_t>(c)));
+    }
+    fclose(f);
+    return true;
+}
+
+static bool writePack(const char *path, const vector<TemplateClass> &classes, bool builtin, int shiftUp,
+                      int shiftDown, float builtinSensitivity) {
+    FILE *f = fopen(path, "wb");
+    if(!f) return false;
+    // native byte order like the bench's WAV and trace files
+    pop_template_pack_header_t header = {POP_TEMPLATE_PACK_MAGIC, POP_TEMPLATE_PACK_VERSION,
+                                         static_cast<uint32_t>(classes.size() + (builtin ? 1 : 0)),
+                                         POP_TEMPLATE_WIDTH, POP_TEMPLATE_HEIGHT};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if(builtin) {
+        pop_template_pack_entry_t entry = {POP_CODE, builtinSensitivity, kDefaultPopShiftUp, kDefaultPopShiftDown};
+        ok = ok && fwrite(&entry, sizeof(entry), 1, f) == 1;
+        ok = ok && fwrite(kPopTemplate, sizeof(float), kBufferSize, f) == static_cast<size_t>(kBufferSize);
+    }
+    for(size_t c = 0; c < classes.size(); ++c) {
+        pop_template_pack_entry_t entry = {classes[c].code, classes[c].sensitivity, shiftUp, shiftDown};
+        ok = ok && fwrite(&entry, sizeof(entry), 1, f) == 1;
+        ok = ok && fwrite(&classes[c].cells[0], sizeof(float), kBufferSize, f) == static_cast<size_t>(kBufferSize);
+    }
+    return fclose(f) == 0 && ok;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: popclick-templates [options] -o out.pack rec1.wav rec1.txt [rec2.wav rec2.txt ...]\n"
+        "  -o PATH           where to write the template pack\n"
+        "  --builtin         also put the built in pop template in the pack\n"
+        "  --sensitivity S   use S for every learned template instead of learning it\n"
+        "  --margin M        learned sensitivity is the farthest example times M (default 1.2)\n"
+        "  --shift-up N      how many bins the templates can move up to match (default %d)\n"
+        "  --shift-down N    how many bins the templates can move down to match (default %d)\n",
+        kDefaultPopShiftUp, kDefaultPopShiftDown);
+}
+
+int main(int argc, char **argv) {
+    const char *outPath = NULL;
+    bool builtin = false;
+    float sensitivity = 0.0f, margin = kDefaultMargin;
+    int shiftUp = kDefaultPopShiftUp, shiftDown = kDefaultPopShiftDown;
+    vector<const char*> inputs;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "-o" && hasValue) outPath = argv[++i];
+        else if(arg == "--builtin") builtin = true;
+        else if(arg == "--sensitivity" && hasValue) sensitivity = static_cast<float>(atof(argv[++i]));
+        else if(arg == "--margin" && hasValue) margin = static_cast<float>(atof(argv[++i]));
+        else if(arg == "--shift-up" && hasValue) shiftUp = atoi(argv[++i]);
+        else if(arg == "--shift-down" && hasValue) shiftDown = atoi(argv[++i]);
+        else if(arg[0] != '-') inputs.push_back(argv[i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if(!outPath || inputs.size() % 2 != 0 || (inputs.empty() && !builtin)) {
+        usage();
+        return 1;
+    }
+
+    vector<TemplateClass> classes;
+    vector<Recording> recordings(inputs.size() / 2);
+    for(size_t r = 0; r < recordings.size(); ++r) {
+        if(!loadRecording(inputs[2*r], inputs[2*r+1], classes, recordings[r])) return 1;
+    }
+
+    // averaging examples scaled to the same max keeps a few loud ones from drowning out the rest. A label whose
+    // examples were all skipped gets no template, the other labels still do.
+    vector<TemplateClass> usable;
+    vector<int> usableIndex(classes.size(), -1);
+    for(size_t c = 0; c < classes.size(); ++c) {
+        TemplateClass &templ = classes[c];
+        templ.cells.assign(kBufferSize, 0.0f);
+        for(size_t e = 0; e < templ.examples.size(); ++e) {
+            for(int i = 0; i < kBufferSize; ++i) templ.cells[i] += templ.examples[e][i] / templ.examples.size();
+        }
+        if(!(*max_element(templ.cells.begin(), templ.cells.end()) > 0.0f)) {
+            fprintf(stderr, "No usable examples of %s, leaving it out\n", templ.name.c_str());
+            continue;
+        }
+        usableIndex[c] = static_cast<int>(usable.size());
+        usable.push_back(templ);
+    }
+    classes.swap(usable);
+    for(size_t r = 0; r < recordings.size(); ++r) {
+        vector<pair<int, size_t> > &examples = recordings[r].examples;
+        size_t kept = 0;
+        for(size_t e = 0; e < examples.size(); ++e) {
+            if(usableIndex[examples[e].second] < 0) continue;
+            examples[kept++] = make_pair(examples[e].first, static_cast<size_t>(usableIndex[examples[e].second]));
+        }
+        examples.resize(kept);
+    }
+    if(classes.empty() && !builtin) {
+        fprintf(stderr, "No label has any usable examples, not writing %s\n", outPath);
+        return 1;
+    }
+
+    vector<PopTemplateTable> tables;
+    tables.reserve(classes.size());
+    vector<PopTemplate> templates(classes.size());
+    for(size_t c = 0; c < classes.size(); ++c) {
+        TemplateClass &templ = classes[c];
+        float templMax = *max_element(templ.cells.begin(), templ.cells.end());
+        tables.push_back(PopTemplateTable(&templ.cells[0], templMax));
+        templates[c].table = &tables.back();
+        templates[c].code = templ.code;
+        popShiftRange(shiftUp, shiftDown, templates[c]);
+    }
+
+    // how far every example is from its own template, and how close the other labels come to it
+    vector<vector<float> > own(classes.size());
+    vector<float> closestOther(classes.size(), INFINITY);
+    for(size_t r = 0; r < recordings.size(); ++r) {
+        const Recording &recording = recordings[r];
+        for(size_t e = 0; e < recording.examples.size(); ++e) {
+            int first = recording.examples[e].first;
+            size_t label = recording.examples[e].second;
+            for(size_t c = 0; c < classes.size(); ++c) {
+                float diff = bestDistance(recording.hops, first, templates[c]);
+                if(c == label) own[c].push_back(diff);
+                else closestOther[c] = min(closestOther[c], diff);
+            }
+        }
+    }
+    for(size_t c = 0; c < classes.size(); ++c) {
+        TemplateClass &templ = classes[c];
+        sort(own[c].begin(), own[c].end());
+        templ.sensitivity = sensitivity > 0.0f ? sensitivity : own[c].back() * margin;
+        fprintf(stderr, "%-12s code %-6d %3zu examples, distance median %.2f max %.2f, sensitivity %.2f",
+                templ.name.c_str(), templ.code, own[c].size(), own[c][own[c].size() / 2], own[c].back(),
+                templ.sensitivity);
+        if(closestOther[c] < INFINITY) fprintf(stderr, ", closest other label %.2f", closestOther[c]);
+        fprintf(stderr, "%s\n", closestOther[c] < templ.sensitivity ? " (overlaps!)" : "");
+    }
+
+    detectors_config_t config;
+    detectors_default_config(&config);
+    if(!writePack(outPath, classes, builtin, shiftUp, shiftDown, config.popSensitivity)) {
+        fprintf(stderr, "Couldn't write %s\n", outPath);
+        return 1;
+    }
+    fprintf(stderr, "wrote %zu templates to %s\n", classes.size() + (builtin ? 1 : 0), outPath);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "detectorsCommon.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// Checks a pack read into memory and builds the tables for its templates, leaving the pack empty if anything
+// about it is off
+static bool parsePack(const unsigned char *data, size_t size, std::vector<PopTemplateTable> &tables,
+                      std::vector<PopTemplate> &templates) {
+    static const size_t kCells = POP_TEMPLATE_WIDTH * POP_TEMPLATE_HEIGHT;
+    static const size_t kEntrySize = sizeof(pop_template_pack_entry_t) + kCells * sizeof(float);
+
+    if(size < sizeof(pop_template_pack_header_t)) return false;
+    pop_template_pack_header_t header;
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != POP_TEMPLATE_PACK_MAGIC || header.version != POP_TEMPLATE_PACK_VERSION) return false;
+    if(header.width != POP_TEMPLATE_WIDTH || header.height != POP_TEMPLATE_HEIGHT) return false;
+    if(header.count == 0 || header.count > POP_TEMPLATE_PACK_MAX_TEMPLATES) return false;
+    if(size != sizeof(header) + header.count * kEntrySize) return false;
+
+    // reserved up front so the tables never move once templates point at them
+    tables.reserve(header.count);
+    templates.reserve(header.count);
+    const unsigned char *p = data + sizeof(header);
+    for(uint32_t i = 0; i < header.count; ++i, p += kEntrySize) {
+        pop_template_pack_entry_t entry;
+        memcpy(&entry, p, sizeof(entry));
+        // one bit per code at or above POP_CODE so codes can be or'd together like the built in events
+        if(entry.code < POP_CODE || (entry.code & (entry.code - 1)) != 0) return false;
+        if(!(entry.sensitivity > 0.0f) || !std::isfinite(entry.sensitivity)) return false;
+
+        float cells[kCells];
+        memcpy(cells, p + sizeof(entry), sizeof(cells));
+        float templMax = 0.0f;
+        for(size_t c = 0; c < kCells; ++c) {
+            if(!std::isfinite(cells[c]) || cells[c] < 0.0f) return false;
+            templMax = std::max(templMax, cells[c]);
+        }
+        if(templMax <= 0.0f) return false;
+
+        tables.push_back(PopTemplateTable(cells, templMax));
+        PopTemplate templ;
+        templ.table = &tables.back();
+        templ.code = entry.code;
+        templ.sensitivity = entry.sensitivity;
+        popShiftRange(entry.maxShiftUp, entry.maxShiftDown, templ);
+        templates.push_back(templ);
+    }
+    return true;
+}
+
+bool TemplatePack::load(const char *path) {
+    m_tables.clear();
+    m_templates.clear();
+    m_totals.clear();
+    m_totalRadius = 0.0f;
+
+    // Every template gets expanded into its own shifted table, so nothing points into the file afterwards and
+    // one plain read of it is all loading needs
+    FILE *file = fopen(path, "rb");
+    if(!file) return false;
+    std::vector<unsigned char> data;
+    unsigned char chunk[16384];
+    size_t got;
+    while((got = fread(chunk, 1, sizeof(chunk), file)) > 0) data.insert(data.end(), chunk, chunk + got);
+    bool readOk = !ferror(file);
+    fclose(file);
+    if(!readOk || data.empty()) return false;
+
+    bool ok = parsePack(&data[0], data.size(), m_tables, m_templates);
+    if(!ok) {
+        m_tables.clear();
+        m_templates.clear();
+        return false;
+    }
+
+    for(int t = 0; t < size(); ++t) {
+        const PopTemplate &templ = m_templates[t];
+        for(int s = templ.firstShift; s < templ.firstShift + templ.numShifts; ++s) {
+            PopTemplateTotal total = {0.0f, t};
+            for(int col = 0; col < kBufferWidth; ++col) total.total += templ.table->columnSums[s][col];
+            m_totals.push_back(total);
+        }
+        m_totalRadius = std::max(m_totalRadius, templ.sensitivity * kPopBoundSlack);
+    }
+    std::sort(m_totals.begin(), m_totals.end());
+    return true;
+}
+
+extern "C" {
+    pop_templates_t *pop_templates_load(const char *path) {
+        TemplatePack *pack = new TemplatePack();
+        if(!pack->load(path)) {
+            delete pack;
+            return NULL;
+        }
+        return reinterpret_cast<pop_templates_t*>(pack);
+    }
+    void pop_templates_free(pop_templates_t *templates) {
+        delete reinterpret_cast<TemplatePack*>(templates);
+    }
+    size_t pop_templates_count(const pop_templates_t *templates) {
+        return reinterpret_cast<const TemplatePack*>(templates)->size();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef _TEMPLATE_PACK_H_
+#define _TEMPLATE_PACK_H_
+
+// Pop template packs hold any number of learned templates for mouth noises, to match instead of the one compiled
+// into popTemplate.h. Each template is reported as its own event code with its own sensitivity and shift range, so
+// new noises or a template tuned to one microphone don't need a rebuild. popclick-templates builds packs from
+// labelled recordings.
+//
+// A pack is in native byte order like the bench's WAV and trace files: a pop_template_pack_header_t followed by
+// count entries, each a pop_template_pack_entry_t followed by width*height floats. The floats are the pop
+// history the detectors see, oldest column first, each column being the power of FFT bins 0 to 24 and then the
+// sum of all the higher bins. Only the shape matters, templates are scaled to a max of 1 when loaded.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POP_TEMPLATE_PACK_MAGIC 0x4B505450 // "PTPK"
+#define POP_TEMPLATE_PACK_VERSION 1
+#define POP_TEMPLATE_WIDTH 40
+#define POP_TEMPLATE_HEIGHT 26
+#define POP_TEMPLATE_PACK_MAX_TEMPLATES 256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t width; // must be POP_TEMPLATE_WIDTH
+    uint32_t height; // must be POP_TEMPLATE_HEIGHT
+} pop_template_pack_header_t;
+
+typedef struct {
+    // The event bit reported when this template matches: POP_CODE or a higher power of two. Several templates
+    // can share a code to cover variations of one noise.
+    int32_t code;
+    // the largest template distance that still counts as a match, like detectors_config_t::popSensitivity
+    float sensitivity;
+    // clamped to DETECTORS_MAX_POP_SHIFT_UP/DOWN like the configuration's shifts
+    int32_t maxShiftUp;
+    int32_t maxShiftDown;
+} pop_template_pack_entry_t;
+
+typedef void pop_templates_t; // opaque wrapper for the C++ type
+// Returns NULL if the file can't be read or isn't a valid pack. The file is read once and copied into tables, so
+// it can change or go away afterwards. Once loaded a pack is only ever read, so any number of detectors on any
+// threads can share it as long as it outlives them.
+pop_templates_t *pop_templates_load(const char *path);
+void pop_templates_free(pop_templates_t *templates);
+size_t pop_templates_count(const pop_templates_t *templates);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif